@@ -2,18 +2,33 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define MAX_LEN 1000
 #define MAX_NAME 11
 #define MAX_NUM 5
-#define MAX_SYMBOL_TABLE_SIZE 500
-#define CODE_SIZE 512
+#define CODE_SIZE 16 // initial code array size of a basic block, it doubles as needed
+#define MAX_CODE 1000000 // default instruction limit (-maxcode)
+#define LOOKAHEAD 4 // tokens kept by the parser, a power of two
+#define INLINE_SIZE 8 // largest procedure body inlined at every call (-O)
 
 // function prototypes
-void lexicalAnalyzer(char* source, int *size, FILE* outputFile);
-int isReservedWord(char* word);
-int isSpecialSymbol(char* symbol);
+void initScanner();
+void startScanner(const char* source, int length, FILE* outputFile);
+int keywordHash(const char* word, int len);
+int isReservedWord(const char* word, int len);
 int getNextToken();
+int scanToken(int *payload);
+int lastPayload();
+void printErrorLine();
 void error(int i);
 void program();
 void block();
@@ -25,12 +40,58 @@ void expression();
 void term();
 void factor();
 void emit(int op, int L, int M);
-int symbolTableCheck(char* name, int checkCurrentScopeOnly);
-void addToSymbolTable(int kind, char *name, int val, int level, int addr, int mark);
+int newBlock();
+void startBlock(int b);
+void endBlock(int op, int L, int target, int next);
+void lowerProgram();
+void optimizeProgram();
+void foldBranches();
+void eliminateDeadCode();
+void addLoop(int preheader, int header, int end);
+void growSymbolTable();
+int addTemporary(int proc);
+void computeStores();
+void hoistInvariants();
+void rotateLoops();
+void numberValues();
+void inlineProcedures();
+int addProcedure();
+void printIR();
+void emitOperation(int op, int left, int right);
+void setDepth(int at, int depth);
+void reverseCode(int from, int to);
+int isConstant(int from, int to, int *value);
+int isPure(int from, int to);
+int foldOperation(int op, int a, int b, int *result);
+void printOptimizationReport();
+int jumpTarget(int i);
+void resolveAddresses();
+void peephole();
+int peepholePass(char *removed, char *targeted);
+void removeInstructions(const char *removed);
+int symbolTableCheck(int name, int checkCurrentScopeOnly);
+void addToSymbolTable(int kind, int name, int val, int level, int addr, int mark);
 void printSymbolTable(FILE* outputFile);
-int addName(char* name);
+void initNames();
+void* arenaAlloc(size_t bytes);
+void* arenaGrow(void* old, size_t oldBytes, size_t newBytes);
+void arenaReset();
+void resetCompiler();
+unsigned hashName(const char* name, int len);
+int addName(const char* name, int len);
+char* nameOf(int id);
 void procedure();
 void exitScope(int level);
+void growVisible();
+void printTokenList();
+int lexerBenchmark(int mb);
+char* repeatChunk(const char* chunk, int mb, size_t *length);
+double timeScanner(const char* source, size_t length, int *size, FILE* devNull);
+void compareSkipping(const char* what, const char* source, size_t length, FILE* devNull);
+const char* skipSpace(const char* p, const char* end);
+const char* skipComment(const char* p, const char* end);
+char* loadSource(const char* filename, size_t *length, int *mapped);
+void freeSource(char* source, size_t length, int mapped);
 
 // token numbers
 typedef enum {
@@ -52,28 +113,54 @@ char* tokenStrings[] = {
     "readsym" , "elsesym", "procsym"
 };
 
-// token struct
+// reserved word and special symbol table entry
 typedef struct {
     char lexeme[MAX_NAME];
     int token;
-    int index;
-    int value;
 } TokenPair;
 
+// arena chunk, allocations are bumped out of data until it is full
+typedef struct ArenaChunk {
+    struct ArenaChunk *next; // older chunk
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+// first chunk size, each new chunk doubles the last
+#define ARENA_CHUNK (64 * 1024)
+
+// everything the compiler allocates for a program lives in the arena and
+// is released at once by arenaReset. newest chunk first
+ArenaChunk *arena;
+
 // symbol table struct
 typedef struct {
     int kind;
-    char name[MAX_NAME];
+    int name; // interned name id
     int val;
     int level;
     int addr;
     int mark;
+    int shadowed; // symbol this one hides until its scope exits, -1 if none
+    int proc; // procedure whose block declares it
 } symbol;
 
-// global symbol table
-symbol symbol_table[MAX_SYMBOL_TABLE_SIZE];
+// global symbol table, every symbol ever declared in declaration order
+symbol *symbol_table;
 // symbol table size counter
 int symbolTableSize = 0;
+int symbolTableCapacity = 0;
+// name id -> innermost visible symbol with that name, -1 if none
+int *visible;
+int visibleSize = 0;
+// undo log, the visible symbols in declaration order. the innermost
+// scope's declarations are always on top, so exiting it pops exactly those
+int *scopeLog;
+int scopeLogSize = 0;
+
+// perfect hash slot -> index in reservedWords, -1 if empty
+int keywordSlot[16];
 
 // reserved words
 TokenPair reservedWords[] = {
@@ -98,61 +185,1366 @@ typedef struct {
     int M;
 } instruction;
 
-// instruction array
-instruction text[CODE_SIZE];
-// code index
-int cx = 0;
+// instruction array in the arena, codeCapacity instructions. while parsing
+// it is the code of the basic block being filled, once lowered the program
+instruction *text;
+int codeCapacity = 0;
+
+// basic block: straight-line code, then an optional JMP or JPC to target.
+// a block without a JMP continues in next, -1 if it ends its procedure
+// with a return or halt. JMP and JPC never appear inside code. until
+// resolveAddresses runs, LOD, STO and CAL name their symbol in M and hold
+// the level they are used at in L
+typedef struct {
+    instruction *code;
+    int size;
+    int capacity;
+    instruction branch; // OP 7 JMP, 8 JPC, 0 none. M is set when lowered
+    int target;
+    int next;
+    int proc;    // procedure it belongs to, 0 for the main block
+    int address; // index of its first instruction once lowered
+    int dead;    // unreachable, left out when lowered
+} basicBlock;
+
+// every basic block, laid out in this order when lowered
+basicBlock *blocks;
+int blockCount = 0;
+int blockCapacity = 0;
+// block being filled
+int currentBlock = -1;
+
+// procedure: its entry block, the level of its body and its frame size
+// in words, which its INC allocates
+typedef struct {
+    int entry;
+    int level;
+    int frame;
+} procInfo;
+
+procInfo *procs;
+int procCapacity = 0;
+
+// while loop: the block that falls into it, its condition block and the
+// block after it. the loop is blocks header..end-1, created in between
+typedef struct {
+    int preheader;
+    int header;
+    int end;
+} loopInfo;
+
+loopInfo *loops;
+int loopCount = 0;
+int loopCapacity = 0;
+
+// symbols each procedure may store to outside its own frame, itself or
+// through its calls, as sorted lists. a call never changes the caller's
+// view of the callee's own frame, so those are left out
+int **stores;
+int *storeCounts;
+int *storeCapacities;
+
+void appendCode(basicBlock *block, instruction in);
+// procedure being compiled and procedures so far, 0 is the main block
+int currentProc = 0;
+int procCount = 0;
+// most instructions a program may compile to, a safety valve only
+int maxCode = MAX_CODE;
+// code index
+int cx = 0;
+
+// tokens pulled from the scanner, the last LOOKAHEAD of them stay valid.
+// stored as parallel arrays: the kind, the name id or number value, and
+// the token's offset in the source for diagnostics
+unsigned char tokenKind[LOOKAHEAD];
+int tokenPayload[LOOKAHEAD];
+unsigned tokenOffset[LOOKAHEAD];
+// scanner source, position, end, start of the last token scanned and
+// where lexical errors are also written
+const char *scanSource;
+const char *scanPos;
+const char *scanEnd;
+const char *scanStart;
+FILE *scanOutput;
+// interned names: the text of name id i is nameText[i], in the arena
+char **nameText;
+unsigned *nameHash;
+// name count, ids are 0..nameCount-1
+int nameCount = 0;
+int nameCapacity = 0;
+// open-addressing table of name id + 1, 0 marks an empty slot
+int *nameSlots;
+int slotCount = 0;
+// tokens pulled so far
+int tx = 0;
+// token
+int token = 0;
+// symbol table index
+int symIdx = 0;
+// lexigraphical level
+int level = 0;
+// optimization level (-O), 0 emits code exactly as parsed
+int optLevel = 0;
+// instructions removed by constant folding and simplification
+int foldSaved = 0;
+// conditional jumps on a constant made unconditional
+int branchesFolded = 0;
+// unreachable blocks and procedures removed, unused variable slots dropped
+int deadBlocks = 0;
+int deadProcs = 0;
+int deadSlots = 0;
+// loop-invariant expressions hoisted, loops they came from and the
+// instructions that no longer run on every iteration
+int hoisted = 0;
+int hoistedLoops = 0;
+int hoistSaved = 0;
+// while loops turned into a guard and a bottom test
+int loopsRotated = 0;
+// expressions computed again in a block that reuse the earlier value
+int valuesReused = 0;
+int reuseSaved = 0;
+// calls replaced by the procedure body and procedures inlined
+int callsInlined = 0;
+int procsInlined = 0;
+// operations whose operands were swapped to evaluate the deeper one first
+int operandsSwapped = 0;
+// stack words needed to compute the value whose code ends at text[i] in
+// the current block, kept for the expression being parsed (-O)
+int *depthAt;
+int depthCapacity = 0;
+
+// peephole rules, each can be turned off with -nopeep <name>
+enum { PEEP_LOAD_STORE, PEEP_JUMP_NEXT, PEEP_JUMP_CHAIN, PEEP_IDENTITY, PEEP_RULES };
+char* peepholeNames[] = { "load-store", "jump-next", "jump-chain", "identity" };
+int peepholeEnabled[PEEP_RULES] = { 1, 1, 1, 1 };
+// times each rule fired
+int peepholeHits[PEEP_RULES];
+
+// perfect hash of a reserved word: (2*c0 + 12*c1 + 3*len) & 15 maps the
+// 13 reserved words to distinct slots (parameters found by search offline)
+int keywordHash(const char* word, int len) {
+    return (2 * (unsigned char)word[0] + 12 * (unsigned char)word[1] + 3 * len) & 15;
+}
+
+// check if word is a reserved word, one hash and one compare
+int isReservedWord(const char* word, int len) {
+    if (len < 2 || len > 9) {
+        return -1;
+    }
+    int i = keywordSlot[keywordHash(word, len)];
+    if (i >= 0 && memcmp(word, reservedWords[i].lexeme, len) == 0 && reservedWords[i].lexeme[len] == '\0') {
+        return reservedWords[i].token;
+    }
+    return -1;
+}
+
+// emit
+void emit(int op, int L, int M) {
+    if (cx >= maxCode) {
+        printf("Exceeded maximum instruction count\n");
+        exit(1);
+    } else {
+        if (cx == codeCapacity) {
+            int capacity = codeCapacity ? codeCapacity * 2 : CODE_SIZE;
+            text = arenaGrow(text, codeCapacity * sizeof(instruction), capacity * sizeof(instruction));
+            codeCapacity = capacity;
+        }
+        text[cx].OP = op;
+        text[cx].L = L;
+        text[cx].M = M;
+        cx++;
+    }
+}
+
+// append an empty basic block to the current procedure and return it
+int newBlock() {
+    if (blockCount == blockCapacity) {
+        int capacity = blockCapacity ? blockCapacity * 2 : 64;
+        blocks = arenaGrow(blocks, blockCapacity * sizeof(basicBlock), capacity * sizeof(basicBlock));
+        blockCapacity = capacity;
+    }
+    basicBlock *b = &blocks[blockCount];
+    b->code = NULL;
+    b->size = 0;
+    b->capacity = 0;
+    b->branch.OP = 0;
+    b->branch.L = 0;
+    b->branch.M = 0;
+    b->target = -1;
+    b->next = -1;
+    b->proc = currentProc;
+    b->address = 0;
+    b->dead = 0;
+    if (procs[currentProc].entry == -1) {
+        procs[currentProc].entry = blockCount;
+    }
+    return blockCount++;
+}
+
+// add a procedure for the body at the current level + 1 (the main block
+// is at level 0), its entry is the next block created
+int addProcedure() {
+    if (procCount == procCapacity) {
+        int capacity = procCapacity ? procCapacity * 2 : 16;
+        procs = arenaGrow(procs, procCapacity * sizeof(procInfo), capacity * sizeof(procInfo));
+        procCapacity = capacity;
+    }
+    procs[procCount].entry = -1;
+    procs[procCount].level = procCount == 0 ? 0 : level;
+    procs[procCount].frame = 3;
+    return procCount++;
+}
+
+// make b the block emit appends to
+void startBlock(int b) {
+    if (currentBlock >= 0) {
+        blocks[currentBlock].code = text;
+        blocks[currentBlock].size = cx;
+        blocks[currentBlock].capacity = codeCapacity;
+    }
+    currentBlock = b;
+    text = blocks[b].code;
+    cx = blocks[b].size;
+    codeCapacity = blocks[b].capacity;
+}
+
+// end the current block with a JMP or JPC (op 7 or 8, 0 for none) to
+// target, going on to next. a target not known yet is set by the caller
+void endBlock(int op, int L, int target, int next) {
+    blocks[currentBlock].branch.OP = op;
+    blocks[currentBlock].branch.L = L;
+    blocks[currentBlock].target = target;
+    blocks[currentBlock].next = next;
+}
+
+// lay the blocks out in order into one instruction array, text[0..cx),
+// and give each block its address. a JMP or JPC keeps its target block
+// in M as a label, and a block whose next is not the block after it gets
+// a JMP there. resolveAddresses turns labels into addresses afterwards
+void lowerProgram() {
+    startBlock(currentBlock); // save the last block
+    // following[b] is the live block laid out after b, -1 for the last
+    int *following = arenaAlloc(blockCount * sizeof(int));
+    int after = -1;
+    for (int b = blockCount - 1; b >= 0; b--) {
+        following[b] = after;
+        if (!blocks[b].dead) {
+            after = b;
+        }
+    }
+    int address = 0;
+    for (int b = 0; b < blockCount; b++) {
+        if (blocks[b].dead) {
+            continue;
+        }
+        blocks[b].address = address;
+        address += blocks[b].size + (blocks[b].branch.OP != 0);
+        if (blocks[b].branch.OP != 7 && blocks[b].next != -1 && blocks[b].next != following[b]) {
+            address++;
+        }
+    }
+    if (address > maxCode) {
+        printf("Exceeded maximum instruction count\n");
+        exit(1);
+    }
+
+    currentBlock = -1;
+    text = arenaAlloc(address * sizeof(instruction));
+    codeCapacity = address;
+    cx = 0;
+    for (int b = 0; b < blockCount; b++) {
+        if (blocks[b].dead) {
+            continue;
+        }
+        if (blocks[b].size > 0) {
+            memcpy(&text[cx], blocks[b].code, blocks[b].size * sizeof(instruction));
+            cx += blocks[b].size;
+        }
+        if (blocks[b].branch.OP != 0) {
+            emit(blocks[b].branch.OP, blocks[b].branch.L, blocks[b].target); // JMP or JPC
+        }
+        if (blocks[b].branch.OP != 7 && blocks[b].next != -1 && blocks[b].next != following[b]) {
+            emit(7, 0, blocks[b].next); // JMP
+        }
+    }
+}
+
+// link the lowered code: every JMP, JPC and CAL gets the word address of
+// its target block (the pc counts words, three per instruction), and LOD,
+// STO and CAL get the number of static links from where they are used to
+// where their symbol was declared, LOD and STO its frame offset. INC gets
+// its procedure's frame size
+void resolveAddresses() {
+    for (int i = 0; i < cx; i++) {
+        if (text[i].OP == 7 || text[i].OP == 8) {
+            text[i].M = blocks[text[i].M].address * 3;
+        } else if (text[i].OP == 6) {
+            text[i].M = procs[text[i].M].frame;
+        } else if (text[i].OP == 3 || text[i].OP == 4 || text[i].OP == 5) {
+            symbol *s = &symbol_table[text[i].M];
+            text[i].L -= s->level;
+            if (text[i].OP == 5) {
+                text[i].M = blocks[procs[s->addr].entry].address * 3;
+            } else {
+                text[i].M = s->addr;
+            }
+        }
+    }
+}
+
+// optimize the basic blocks before they are lowered (-O)
+void optimizeProgram() {
+    startBlock(currentBlock); // save the last block
+    inlineProcedures();
+    foldBranches();
+    eliminateDeadCode();
+    computeStores();
+    hoistInvariants();
+    rotateLoops();
+    numberValues();
+    // the passes replace block code, the last block's too: load it again
+    // without saving, so later saves keep their code and not the parser's
+    int last = currentBlock;
+    currentBlock = -1;
+    startBlock(last);
+}
+
+void addLoop(int preheader, int header, int end) {
+    if (loopCount == loopCapacity) {
+        int capacity = loopCapacity ? loopCapacity * 2 : 16;
+        loops = arenaGrow(loops, loopCapacity * sizeof(loopInfo), capacity * sizeof(loopInfo));
+        loopCapacity = capacity;
+    }
+    loops[loopCount].preheader = preheader;
+    loops[loopCount].header = header;
+    loops[loopCount].end = end;
+    loopCount++;
+}
+
+// append in to a block's code outside of parsing
+void appendCode(basicBlock *block, instruction in) {
+    if (block->size == block->capacity) {
+        int capacity = block->capacity ? block->capacity * 2 : CODE_SIZE;
+        block->code = arenaGrow(block->code, block->capacity * sizeof(instruction), capacity * sizeof(instruction));
+        block->capacity = capacity;
+    }
+    block->code[block->size++] = in;
+}
+
+// replace procedure p's stores[] list with count symbols from list
+void setStores(int p, const int *list, int count) {
+    if (count > storeCapacities[p]) {
+        int capacity = count * 2;
+        stores[p] = arenaGrow(stores[p], storeCapacities[p] * sizeof(int), capacity * sizeof(int));
+        storeCapacities[p] = capacity;
+    }
+    memcpy(stores[p], list, count * sizeof(int));
+    storeCounts[p] = count;
+}
+
+// order symbols, for qsort
+int compareInts(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return x < y ? -1 : x > y;
+}
+
+// add what callee may store to what p may, except p's own variables,
+// merging the two sorted lists through merged. returns whether p's grew
+int mergeStores(int p, int callee, int *merged) {
+    const int *mine = stores[p], *theirs = stores[callee];
+    int i = 0, j = 0, n = 0, grew = 0;
+    while (i < storeCounts[p] || j < storeCounts[callee]) {
+        if (j == storeCounts[callee] || (i < storeCounts[p] && mine[i] <= theirs[j])) {
+            if (j < storeCounts[callee] && mine[i] == theirs[j]) {
+                j++;
+            }
+            merged[n++] = mine[i++];
+        } else {
+            if (symbol_table[theirs[j]].proc != p) {
+                merged[n++] = theirs[j];
+                grew = 1;
+            }
+            j++;
+        }
+    }
+    if (grew) {
+        setStores(p, merged, n);
+    }
+    return grew;
+}
+
+// fill stores[] for the live code: each procedure's own STOs outside its
+// frame, then what the procedures it calls store, until nothing changes.
+// this is what a CAL may modify, the only aliasing PL/0 has
+void computeStores() {
+    stores = arenaAlloc(procCount * sizeof(int*));
+    storeCounts = arenaAlloc(procCount * sizeof(int));
+    storeCapacities = arenaAlloc(procCount * sizeof(int));
+    memset(stores, 0, procCount * sizeof(int*));
+    memset(storeCounts, 0, procCount * sizeof(int));
+    memset(storeCapacities, 0, procCount * sizeof(int));
+    for (int b = 0; b < blockCount; b++) {
+        int p = blocks[b].proc;
+        for (int i = 0; !blocks[b].dead && i < blocks[b].size; i++) {
+            int m = blocks[b].code[i].M;
+            if (blocks[b].code[i].OP != 4 || symbol_table[m].proc == p) {
+                continue;
+            }
+            if (storeCounts[p] == storeCapacities[p]) {
+                int capacity = storeCapacities[p] ? storeCapacities[p] * 2 : 4;
+                stores[p] = arenaGrow(stores[p], storeCapacities[p] * sizeof(int), capacity * sizeof(int));
+                storeCapacities[p] = capacity;
+            }
+            stores[p][storeCounts[p]++] = m;
+        }
+    }
+    for (int p = 0; p < procCount; p++) {
+        if (storeCounts[p] == 0) {
+            continue; // nothing to sort, and stores[p] is still NULL
+        }
+        qsort(stores[p], storeCounts[p], sizeof(int), compareInts);
+        int n = 0;
+        for (int k = 0; k < storeCounts[p]; k++) {
+            if (n == 0 || stores[p][n - 1] != stores[p][k]) {
+                stores[p][n++] = stores[p][k];
+            }
+        }
+        storeCounts[p] = n;
+    }
+    // no list holds a symbol twice, so a merge never needs more room
+    int *merged = arenaAlloc((symbolTableSize + 1) * sizeof(int));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int b = 0; b < blockCount; b++) {
+            for (int i = 0; !blocks[b].dead && i < blocks[b].size; i++) {
+                if (blocks[b].code[i].OP == 5) {
+                    changed |= mergeStores(blocks[b].proc, symbol_table[blocks[b].code[i].M].addr, merged);
+                }
+            }
+        }
+    }
+}
+
+// a value on the expression stack while scanning a block: code[start..end)
+// computes it with ops operators, and pure means it only reads variables
+// the loop leaves alone and cannot fault
+typedef struct {
+    int start;
+    int end;
+    int pure;
+    int ops;
+} stackValue;
+
+// order stack values by where their code starts, for qsort
+int compareStart(const void *a, const void *b) {
+    return ((const stackValue*)a)->start - ((const stackValue*)b)->start;
+}
+
+// find the largest loop-invariant expressions in a block's code, which the
+// consumer of each (a STO, write, JPC or an operator with a varying other
+// operand) shows. returns how many, their ranges in starts[] and ends[] by start
+int findInvariants(basicBlock *block, const unsigned char *modified, int *starts, int *ends) {
+    stackValue *stack = arenaAlloc((block->size + 1) * sizeof(stackValue));
+    stackValue *kept = arenaAlloc((block->size + 1) * sizeof(stackValue));
+    int sp = 0, count = 0;
+    for (int i = 0; i < block->size; i++) {
+        instruction in = block->code[i];
+        int pops = 0, pushes = 0, pure = 1;
+        if (in.OP == 1) {
+            pushes = 1;
+        } else if (in.OP == 3) {
+            pushes = 1;
+            pure = !(modified[in.M / 8] & (1 << (in.M % 8)));
+        } else if (in.OP == 2 && in.M == 11) {
+            pops = pushes = 1;
+        } else if (in.OP == 2 && in.M >= 1 && in.M <= 10) {
+            pops = 2;
+            pushes = 1;
+            pure = in.M != 4; // DIV can fault
+        } else if (in.OP == 4 || (in.OP == 9 && in.M == 1)) {
+            pops = 1;
+        } else if (in.OP == 9 && in.M == 2) {
+            pushes = 1;
+            pure = 0; // read
+        }
+        if (sp < pops) {
+            return 0; // not expression code as expected, leave the block alone
+        }
+        stackValue value = { i, i + 1, pure, pops > 0 && pushes > 0 };
+        for (int k = sp - pops; k < sp; k++) {
+            value.pure = value.pure && stack[k].pure;
+            value.ops += stack[k].ops;
+        }
+        if (pops > 0) {
+            value.start = stack[sp - pops].start;
+        }
+        // operands end up here if the result is not invariant itself
+        for (int k = sp - pops; k < sp; k++) {
+            if ((pushes == 0 || !value.pure) && stack[k].pure && stack[k].ops > 0) {
+                kept[count++] = stack[k];
+            }
+        }
+        sp -= pops;
+        if (pushes > 0) {
+            stack[sp++] = value;
+        }
+    }
+    for (int k = 0; k < sp; k++) {
+        if (stack[k].pure && stack[k].ops > 0) {
+            kept[count++] = stack[k];
+        }
+    }
+    // they were found as they got consumed, the caller needs them in order
+    qsort(kept, count, sizeof(stackValue), compareStart);
+    for (int k = 0; k < count; k++) {
+        starts[k] = kept[k].start;
+        ends[k] = kept[k].end;
+    }
+    return count;
+}
+
+// whether calling procedure proc may change symbol m. temporaries made
+// after computeStores are never stored to by another call
+int mayStore(int proc, int m) {
+    return storeCounts[proc] > 0 && bsearch(&m, stores[proc], storeCounts[proc], sizeof(int), compareInts) != NULL;
+}
+
+// loop-invariant code motion: for each while loop, an
+// expression in its condition or body that only reads variables nothing in
+// the loop stores to, directly or through a CAL, and that cannot fault is
+// computed once into a temporary in the block before the loop and loaded
+// from it inside. equal expressions in one loop share a temporary. loops
+// are recorded as they close, inner first, so what moves out of an inner
+// loop can move out of the outer one too
+void hoistInvariants() {
+    if (loopCount == 0) {
+        return;
+    }
+    // one bit per symbol, shared by every loop
+    unsigned char *modified = NULL;
+    int modifiedBytes = 0;
+    for (int l = 0; l < loopCount; l++) {
+        loopInfo *loop = &loops[l];
+        if (blocks[loop->header].dead) {
+            continue;
+        }
+        int proc = blocks[loop->header].proc;
+        int useLevel = procs[proc].level;
+        // temporaries from inner loops count, they are stored to in here
+        int bytes = (symbolTableSize + 7) / 8;
+        if (bytes > modifiedBytes) {
+            modified = arenaGrow(modified, modifiedBytes, bytes * 2);
+            modifiedBytes = bytes * 2;
+        }
+        memset(modified, 0, modifiedBytes);
+        for (int b = loop->header; b < loop->end; b++) {
+            for (int i = 0; !blocks[b].dead && i < blocks[b].size; i++) {
+                int m = blocks[b].code[i].M;
+                if (blocks[b].code[i].OP == 4) {
+                    modified[m / 8] |= 1 << (m % 8);
+                } else if (blocks[b].code[i].OP == 5) {
+                    int callee = symbol_table[m].addr;
+                    for (int k = 0; k < storeCounts[callee]; k++) {
+                        modified[stores[callee][k] / 8] |= 1 << (stores[callee][k] % 8);
+                    }
+                }
+            }
+        }
+
+        // temporaries made for this loop and the code each holds
+        int temps = 0;
+        int *tempSymbol = NULL, *tempFrom = NULL, *tempLength = NULL;
+        basicBlock *preheader = &blocks[loop->preheader];
+        int before = hoisted;
+        for (int b = loop->header; b < loop->end; b++) {
+            basicBlock *block = &blocks[b];
+            if (block->dead) {
+                continue;
+            }
+            int *starts = arenaAlloc((block->size + 1) * sizeof(int));
+            int *ends = arenaAlloc((block->size + 1) * sizeof(int));
+            int count = findInvariants(block, modified, starts, ends);
+            tempSymbol = arenaGrow(tempSymbol, temps * sizeof(int), (temps + count) * sizeof(int));
+            tempFrom = arenaGrow(tempFrom, temps * sizeof(int), (temps + count) * sizeof(int));
+            tempLength = arenaGrow(tempLength, temps * sizeof(int), (temps + count) * sizeof(int));
+            // last first, so earlier ranges stay where they were
+            for (int k = count - 1; k >= 0; k--) {
+                int length = ends[k] - starts[k];
+                int t = 0;
+                while (t < temps && !(tempLength[t] == length &&
+                       memcmp(&preheader->code[tempFrom[t]], &block->code[starts[k]], length * sizeof(instruction)) == 0)) {
+                    t++;
+                }
+                if (t == temps) {
+                    tempSymbol[t] = addTemporary(proc);
+                    tempFrom[t] = preheader->size;
+                    tempLength[t] = length;
+                    for (int i = starts[k]; i < ends[k]; i++) {
+                        appendCode(preheader, block->code[i]);
+                    }
+                    instruction store = { 4, useLevel, tempSymbol[t] };
+                    appendCode(preheader, store); // STO
+                    temps++;
+                    hoisted++;
+                }
+                block->code[starts[k]].OP = 3; // LOD
+                block->code[starts[k]].L = useLevel;
+                block->code[starts[k]].M = tempSymbol[t];
+                memmove(&block->code[starts[k] + 1], &block->code[ends[k]], (block->size - ends[k]) * sizeof(instruction));
+                block->size -= length - 1;
+                hoistSaved += length - 1;
+            }
+        }
+        hoistedLoops += hoisted > before;
+    }
+}
+
+// an expression in a block being value numbered: code[start..end) computes
+// it, match is the earlier equal one it can reuse (-1 for none), holder the
+// temporary or variable keeping its value for later ones
+typedef struct {
+    int start;
+    int end;
+    unsigned hash;
+    int match;
+    int holder;
+} blockValue;
+
+// whether the value of code[start..end) is still what it was after
+// the code up to before ran: no variable it loads was stored to since, by
+// a STO (lastStore[] holds the last one in the block) or a CAL
+int stillValid(basicBlock *block, int start, int end, int before, const int *lastStore, const int *calls, int callCount) {
+    for (int i = start; i < end; i++) {
+        if (block->code[i].OP != 3) {
+            continue;
+        }
+        int m = block->code[i].M;
+        if (lastStore[m] >= start) {
+            return 0;
+        }
+        for (int c = callCount - 1; c >= 0 && calls[c] >= end; c--) {
+            if (calls[c] < before && mayStore(symbol_table[block->code[calls[c]].M].addr, m)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// value numbering in one block: an expression equal to one computed
+// earlier, with nothing it reads stored to in between, loads the earlier
+// value instead. the earlier one keeps it in the variable it was stored to
+// if that still holds it, else STO and LOD through a new temporary, so
+// only what saves instructions overall is rewritten
+void numberBlock(basicBlock *block, int *lastStore) {
+    int size = block->size;
+    blockValue *values = arenaAlloc((size + 1) * sizeof(blockValue));
+    stackValue *stack = arenaAlloc((size + 1) * sizeof(stackValue));
+    int *calls = arenaAlloc((size + 1) * sizeof(int));
+    int *covered = arenaAlloc((size + 1) * sizeof(int));
+    int tableSize = 16;
+    while (tableSize < 2 * size) {
+        tableSize *= 2;
+    }
+    int *table = arenaAlloc(tableSize * sizeof(int));
+    memset(table, -1, tableSize * sizeof(int));
+    memset(covered, 0, (size + 1) * sizeof(int));
+    int count = 0, callCount = 0, sp = 0;
+    for (int i = 0; i < size; i++) {
+        instruction in = block->code[i];
+        int pops = 0, pushes = 0, usable = 1;
+        if (in.OP == 1 || in.OP == 3) {
+            pushes = 1;
+        } else if (in.OP == 2 && in.M == 11) {
+            pops = pushes = 1;
+        } else if (in.OP == 2 && in.M >= 1 && in.M <= 10) {
+            pops = 2;
+            pushes = 1;
+        } else if (in.OP == 4) {
+            pops = 1;
+            lastStore[in.M] = i;
+        } else if (in.OP == 9 && in.M == 1) {
+            pops = 1;
+        } else if (in.OP == 9 && in.M == 2) {
+            pushes = 1;
+            usable = 0; // read, a new value every time
+        } else if (in.OP == 5) {
+            calls[callCount++] = i;
+        }
+        if (sp < pops) {
+            return; // not expression code as expected, leave the block alone
+        }
+        stackValue value = { i, i + 1, usable, pops > 0 && pushes > 0 };
+        for (int k = sp - pops; k < sp; k++) {
+            value.pure = value.pure && stack[k].pure;
+            value.ops += stack[k].ops;
+        }
+        if (pops > 0) {
+            value.start = stack[sp - pops].start;
+        }
+        sp -= pops;
+        if (pushes == 0) {
+            continue;
+        }
+        stack[sp++] = value;
+        if (!value.pure || value.ops == 0) {
+            continue;
+        }
+
+        blockValue *v = &values[count];
+        v->start = value.start;
+        v->end = value.end;
+        v->hash = hashName((const char*)&block->code[v->start], (v->end - v->start) * sizeof(instruction));
+        v->match = -1;
+        v->holder = -1;
+        int slot = v->hash & (tableSize - 1);
+        while (table[slot] != -1) {
+            blockValue *earlier = &values[table[slot]];
+            if (earlier->hash == v->hash && earlier->end - earlier->start == v->end - v->start &&
+                memcmp(&block->code[earlier->start], &block->code[v->start], (v->end - v->start) * sizeof(instruction)) == 0) {
+                if (!covered[earlier->start] && stillValid(block, earlier->start, earlier->end, v->start, lastStore, calls, callCount)) {
+                    v->match = table[slot];
+                }
+                break;
+            }
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (v->match == -1) {
+            table[slot] = count; // new, or in place of one no longer valid
+        } else {
+            for (int k = v->start; k < v->end; k++) {
+                covered[k] = count + 1;
+            }
+        }
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    // keep the outermost reuses, then what each earlier value saves
+    int *saved = arenaAlloc(count * sizeof(int));
+    int *lastUse = arenaAlloc(count * sizeof(int));
+    memset(saved, 0, count * sizeof(int));
+    for (int k = 0; k < count; k++) {
+        blockValue *v = &values[k];
+        if (v->match != -1 && covered[v->start] != k + 1) {
+            v->match = -1; // inside a larger reused expression
+        }
+        if (v->match != -1) {
+            saved[v->match] += v->end - v->start - 1;
+            lastUse[v->match] = v->start;
+        }
+    }
+    int proc = block->proc;
+    int useLevel = procs[proc].level;
+    int *holderLevel = arenaAlloc(count * sizeof(int));
+    for (int k = 0; k < count; k++) {
+        blockValue *v = &values[k];
+        if (saved[k] == 0) {
+            continue;
+        }
+        // a variable the value goes straight into, if nothing changes it
+        // before its last reuse
+        if (v->end < size && block->code[v->end].OP == 4) {
+            int m = block->code[v->end].M;
+            int changed = 0;
+            for (int i = v->end + 1; i < lastUse[k] && !changed; i++) {
+                changed = (block->code[i].OP == 4 && block->code[i].M == m) ||
+                          (block->code[i].OP == 5 && mayStore(symbol_table[block->code[i].M].addr, m));
+            }
+            if (!changed) {
+                v->holder = m;
+                holderLevel[k] = block->code[v->end].L;
+                continue;
+            }
+        }
+        if (saved[k] > 2) {
+            v->holder = addTemporary(proc);
+            holderLevel[k] = useLevel;
+        }
+    }
+
+    // rewrite: reuses become a LOD of the holder, earlier values held in a
+    // temporary get a STO and LOD after them
+    int *endsValue = arenaAlloc((size + 1) * sizeof(int));
+    memset(endsValue, -1, (size + 1) * sizeof(int));
+    int *reuseAt = arenaAlloc((size + 1) * sizeof(int));
+    memset(reuseAt, -1, (size + 1) * sizeof(int));
+    int extra = 0;
+    for (int k = 0; k < count; k++) {
+        blockValue *v = &values[k];
+        if (v->holder != -1 && block->code[v->end].OP != 4) {
+            endsValue[v->end - 1] = k;
+            extra += 2;
+        }
+        if (v->match != -1 && values[v->match].holder != -1) {
+            reuseAt[v->start] = k;
+        }
+    }
+    instruction *code = arenaAlloc((size + extra) * sizeof(instruction));
+    int n = 0;
+    for (int i = 0; i < size; i++) {
+        if (reuseAt[i] != -1) {
+            blockValue *v = &values[reuseAt[i]];
+            instruction load = { 3, holderLevel[v->match], values[v->match].holder };
+            code[n++] = load; // LOD
+            i = v->end - 1;
+            valuesReused++;
+            reuseSaved += v->end - v->start - 1;
+            continue;
+        }
+        code[n++] = block->code[i];
+        if (endsValue[i] != -1) {
+            instruction store = { 4, useLevel, values[endsValue[i]].holder };
+            instruction load = { 3, useLevel, values[endsValue[i]].holder };
+            code[n++] = store; // STO
+            code[n++] = load; // LOD
+            reuseSaved -= 2;
+        }
+    }
+    block->code = code;
+    block->size = n;
+    block->capacity = size + extra;
+}
+
+// local value numbering over every live block (see numberBlock). CALs
+// may store to variables of enclosing procedures through the static
+// chain, so they invalidate what their procedure's stores[] set names
+void numberValues() {
+    int *lastStore = NULL;
+    int lastStoreSize = 0;
+    for (int b = 0; b < blockCount; b++) {
+        if (blocks[b].dead) {
+            continue;
+        }
+        // numberBlock adds temporaries, the array must still cover them all
+        if (lastStoreSize < symbolTableSize) {
+            lastStore = arenaGrow(lastStore, lastStoreSize * sizeof(int), symbolTableSize * sizeof(int));
+            memset(lastStore + lastStoreSize, -1, (symbolTableSize - lastStoreSize) * sizeof(int));
+            lastStoreSize = symbolTableSize;
+        }
+        // numberBlock leaves the old code alone, its STOs are all the
+        // entries to clear again, not the whole array for every block
+        instruction *code = blocks[b].code;
+        int size = blocks[b].size;
+        numberBlock(&blocks[b], lastStore);
+        for (int i = 0; i < size; i++) {
+            if (code[i].OP == 4) {
+                lastStore[code[i].M] = -1;
+            }
+        }
+    }
+}
+
+// loop rotation: a while loop runs its condition, JPC out, the body and a
+// JMP back every iteration. the condition block stays as a guard in front
+// of the first iteration, and the block ending the body, instead of its JMP
+// back, tests a copy of the condition with the comparison inverted and
+// JPCs to the top of the body while it still holds, so an iteration takes
+// one instruction less. ODD has no inverse operator and is left alone
+void rotateLoops() {
+    for (int l = 0; l < loopCount; l++) {
+        basicBlock *header = &blocks[loops[l].header];
+        if (header->dead || header->branch.OP != 8 || header->size == 0) {
+            continue;
+        }
+        instruction test = header->code[header->size - 1];
+        if (test.OP != 2 || test.M < 5 || test.M > 10) {
+            continue;
+        }
+        int latch = loops[l].header + 1;
+        while (latch < loops[l].end && (blocks[latch].dead || blocks[latch].branch.OP != 7 ||
+               blocks[latch].target != loops[l].header)) {
+            latch++;
+        }
+        if (latch == loops[l].end) {
+            continue;
+        }
+        basicBlock *block = &blocks[latch];
+        for (int i = 0; i < header->size; i++) {
+            appendCode(block, header->code[i]);
+        }
+        // EQL and NEQ, LSS and GEQ, LEQ and GTR
+        static const int inverse[] = { 0, 0, 0, 0, 0, 6, 5, 10, 9, 8, 7 };
+        block->code[block->size - 1].M = inverse[test.M];
+        block->branch = header->branch; // JPC
+        block->target = header->next;
+        block->next = header->target;
+        loopsRotated++;
+    }
+}
+
+// the body block of procedure p if it can be inlined: one straight-line
+// block, INC first and RTN last, that calls nothing, so it cannot be
+// recursive either. -1 if not
+int inlineBody(int p) {
+    basicBlock *entry = &blocks[procs[p].entry];
+    if (p == 0 || entry->size != 0 || entry->branch.OP != 7) {
+        return -1;
+    }
+    basicBlock *body = &blocks[entry->target];
+    if (body->branch.OP != 0 || body->next != -1 || body->size < 2 || body->code[0].OP != 6 ||
+        body->code[body->size - 1].OP != 2 || body->code[body->size - 1].M != 0) {
+        return -1;
+    }
+    for (int i = 0; i < body->size; i++) {
+        if (body->code[i].OP == 5) {
+            return -1;
+        }
+    }
+    return entry->target;
+}
+
+// procedure inlining: a CAL to a procedure inlineBody accepts becomes a
+// copy of its body without the INC and RTN, when the body is at most
+// INLINE_SIZE instructions or this is its only call. the copy runs at the
+// caller's level: the lexical level differences of LOD and STO come out of
+// resolveAddresses from the new use level, and the callee's variables get
+// slots of their own in the caller's frame. a procedure whose calls all
+// got inlined becomes a leaf itself, so this repeats until nothing changes
+void inlineProcedures() {
+    int *calls = arenaAlloc(procCount * sizeof(int));
+    int *body = arenaAlloc(procCount * sizeof(int));
+    char *inlined = arenaAlloc(procCount);
+    memset(inlined, 0, procCount);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        // callee variable -> its slot at the call being inlined. the
+        // procedures inlined into this round are not leaves, so their new
+        // temporaries are never looked up here
+        int *slot = arenaAlloc(symbolTableSize * sizeof(int));
+        memset(calls, 0, procCount * sizeof(int));
+        for (int b = 0; b < blockCount; b++) {
+            for (int i = 0; i < blocks[b].size; i++) {
+                if (blocks[b].code[i].OP == 5) {
+                    calls[symbol_table[blocks[b].code[i].M].addr]++;
+                }
+            }
+        }
+        for (int p = 0; p < procCount; p++) {
+            body[p] = calls[p] > 0 ? inlineBody(p) : -1;
+            if (body[p] != -1 && calls[p] > 1 && blocks[body[p]].size - 2 > INLINE_SIZE) {
+                body[p] = -1;
+            }
+        }
+        for (int b = 0; b < blockCount; b++) {
+            basicBlock *block = &blocks[b];
+            int size = block->size;
+            for (int i = 0; i < block->size; i++) {
+                if (block->code[i].OP == 5 && body[symbol_table[block->code[i].M].addr] != -1) {
+                    size += blocks[body[symbol_table[block->code[i].M].addr]].size - 3;
+                }
+            }
+            if (size == block->size) {
+                continue;
+            }
+            int useLevel = procs[block->proc].level;
+            instruction *code = arenaAlloc(size * sizeof(instruction));
+            int n = 0;
+            for (int i = 0; i < block->size; i++) {
+                int callee = block->code[i].OP == 5 ? symbol_table[block->code[i].M].addr : 0;
+                if (block->code[i].OP != 5 || body[callee] == -1) {
+                    code[n++] = block->code[i];
+                    continue;
+                }
+                // only LOD and STO name a symbol in M, LIT and OPR hold a
+                // value or an operator there
+                basicBlock *copy = &blocks[body[callee]];
+                for (int k = 1; k < copy->size - 1; k++) {
+                    instruction in = copy->code[k];
+                    if ((in.OP == 3 || in.OP == 4) && symbol_table[in.M].proc == callee) {
+                        slot[in.M] = -1;
+                    }
+                }
+                for (int k = 1; k < copy->size - 1; k++) {
+                    instruction in = copy->code[k];
+                    in.L = useLevel;
+                    if ((in.OP == 3 || in.OP == 4) && symbol_table[in.M].proc == callee) {
+                        if (slot[in.M] == -1) {
+                            slot[in.M] = addTemporary(block->proc);
+                        }
+                        in.M = slot[in.M];
+                    }
+                    code[n++] = in;
+                }
+                callsInlined++;
+                procsInlined += !inlined[callee];
+                inlined[callee] = 1;
+                changed = 1;
+            }
+            block->code = code;
+            block->size = n;
+            block->capacity = size;
+        }
+    }
+}
+
+// a JPC on a constant, left by folding a condition like 3 < 4, always or
+// never jumps: the LIT and JPC go and the block jumps or falls through
+void foldBranches() {
+    for (int b = 0; b < blockCount; b++) {
+        basicBlock *block = &blocks[b];
+        if (block->branch.OP != 8 || block->size == 0 || block->code[block->size - 1].OP != 1) {
+            continue;
+        }
+        int value = block->code[--block->size].M;
+        if (value == 0) {
+            block->branch.OP = 7; // JMP
+            block->next = -1;
+        } else {
+            block->branch.OP = 0;
+            block->target = -1;
+        }
+        branchesFolded++;
+    }
+}
+
+// mark block b reached and queue it the first time. a block is queued at
+// most once, so work never holds more than blockCount entries
+int reachBlock(int b, char *reached, int *work, int top) {
+    if (!reached[b]) {
+        reached[b] = 1;
+        work[top++] = b;
+    }
+    return top;
+}
+
+// keep only the blocks reachable from the main block's entry, following
+// JMP and JPC edges, fall throughs and CALs into procedure entries. then
+// renumber each procedure's variables so the ones no live code loads or
+// stores take no frame slot
+void eliminateDeadCode() {
+    char *reached = arenaAlloc(blockCount);
+    int *work = arenaAlloc(blockCount * sizeof(int));
+    memset(reached, 0, blockCount);
+    int top = 0;
+    reached[procs[0].entry] = 1;
+    work[top++] = procs[0].entry;
+    while (top > 0) {
+        basicBlock *block = &blocks[work[--top]];
+        for (int i = 0; i < block->size; i++) {
+            if (block->code[i].OP == 5) {
+                top = reachBlock(procs[symbol_table[block->code[i].M].addr].entry, reached, work, top);
+            }
+        }
+        if (block->branch.OP != 0) {
+            top = reachBlock(block->target, reached, work, top);
+        }
+        if (block->branch.OP != 7 && block->next != -1) {
+            top = reachBlock(block->next, reached, work, top);
+        }
+    }
+    for (int b = 0; b < blockCount; b++) {
+        blocks[b].dead = !reached[b];
+        deadBlocks += blocks[b].dead;
+    }
+    for (int p = 1; p < procCount; p++) {
+        deadProcs += !reached[procs[p].entry];
+    }
+
+    // variables in use, then new frame offsets in declaration order
+    int *uses = arenaAlloc(symbolTableSize * sizeof(int));
+    memset(uses, 0, symbolTableSize * sizeof(int));
+    for (int b = 0; b < blockCount; b++) {
+        for (int i = 0; !blocks[b].dead && i < blocks[b].size; i++) {
+            if (blocks[b].code[i].OP == 3 || blocks[b].code[i].OP == 4) {
+                uses[blocks[b].code[i].M]++;
+            }
+        }
+    }
+    for (int p = 0; p < procCount; p++) {
+        procs[p].frame = 3;
+    }
+    for (int i = 0; i < symbolTableSize; i++) {
+        if (symbol_table[i].kind != 2) {
+            continue;
+        }
+        if (uses[i] > 0) {
+            symbol_table[i].addr = procs[symbol_table[i].proc].frame++;
+        } else if (reached[procs[symbol_table[i].proc].entry]) {
+            deadSlots++;
+        }
+    }
+}
+
+// print the basic blocks and their edges (-ir)
+void printIR() {
+    startBlock(currentBlock); // save the last block
+    printf("\nBlock\tProc\tCode\tExit\n");
+    for (int b = 0; b < blockCount; b++) {
+        printf("%d\t%d\t%d\t", b, blocks[b].proc, blocks[b].size);
+        if (blocks[b].dead) {
+            printf("dead\n");
+            continue;
+        } else if (blocks[b].branch.OP == 7) {
+            printf("JMP %d\n", blocks[b].target);
+        } else if (blocks[b].branch.OP == 8) {
+            printf("JPC %d, else %d\n", blocks[b].target, blocks[b].next);
+        } else if (blocks[b].next != -1) {
+            printf("on to %d\n", blocks[b].next);
+        } else {
+            printf("end\n");
+        }
+        for (int i = 0; i < blocks[b].size; i++) {
+            printf("\t\t%d %d %d\n", blocks[b].code[i].OP, blocks[b].code[i].L, blocks[b].code[i].M);
+        }
+    }
+}
+
+// emit OPR op over the operands already emitted at text[left..right) and
+// text[right..cx), ODD takes the one operand text[left..cx). with -O the
+// operation is folded or simplified away where the operands allow it, and
+// one that can take its operands in either order (ADD, MUL, EQL, NEQ, and
+// the comparisons by turning LSS into GTR and LEQ into GEQ) evaluates the
+// operand needing more stack first, so the deeper one runs with nothing
+// under it, Sethi-Ullman style. expressions hold no jumps and nothing
+// jumps into one, so their code can be dropped or moved freely
+void emitOperation(int op, int left, int right) {
+    int before = cx + 1;
+    int a = 0, b = 0, result;
+    int leftConstant = isConstant(left, right, &a);
+    int rightConstant = isConstant(right, cx, &b);
+    if (optLevel > 0 && op == 11 && leftConstant) { // odd c
+        cx = left;
+        emit(1, level, a & 1); // LIT
+    } else if (optLevel > 0 && op != 11 && leftConstant && rightConstant && foldOperation(op, a, b, &result)) {
+        cx = left;
+        emit(1, level, result); // LIT
+    } else if (optLevel > 0 && rightConstant && ((b == 0 && (op == 1 || op == 2)) || (b == 1 && (op == 3 || op == 4)))) {
+        cx = right; // x+0, x-0, x*1, x/1
+    } else if (optLevel > 0 && leftConstant && ((a == 0 && op == 1) || (a == 1 && op == 3))) {
+        // 0+x, 1*x
+        int depth = depthAt[cx - 1];
+        memmove(&text[left], &text[right], (cx - right) * sizeof(instruction));
+        cx -= right - left;
+        setDepth(cx - 1, depth);
+    } else if (optLevel > 0 && op == 3 && ((rightConstant && b == 0 && isPure(left, right)) ||
+                                         (leftConstant && a == 0 && isPure(right, cx)))) {
+        cx = left; // x*0, 0*x
+        emit(1, level, 0); // LIT
+    } else if (optLevel > 0 && op == 2 && right - left == cx - right && isPure(left, right) &&
+               memcmp(&text[left], &text[right], (right - left) * sizeof(instruction)) == 0) {
+        cx = left; // x-x
+        emit(1, level, 0); // LIT
+    } else if (optLevel > 0 && op == 11) {
+        emit(2, level, op); // OPR
+        setDepth(cx - 1, depthAt[cx - 2]);
+    } else if (optLevel > 0) {
+        int leftDepth = depthAt[right - 1], rightDepth = depthAt[cx - 1];
+        // LSS and GTR, LEQ and GEQ with their operands the other way round
+        static const int swapped[] = { 0, 1, 0, 3, 0, 5, 6, 9, 10, 7, 8 };
+        if (rightDepth > leftDepth && swapped[op] != 0) {
+            reverseCode(left, right);
+            reverseCode(right, cx);
+            reverseCode(left, cx);
+            op = swapped[op];
+            int depth = leftDepth;
+            leftDepth = rightDepth;
+            rightDepth = depth;
+            operandsSwapped++;
+        }
+        emit(2, level, op); // OPR
+        setDepth(cx - 1, leftDepth > rightDepth + 1 ? leftDepth : rightDepth + 1);
+    } else {
+        emit(2, level, op); // OPR
+    }
+    foldSaved += before - cx;
+    if (optLevel > 0 && text[cx - 1].OP == 1) {
+        setDepth(cx - 1, 1); // folded
+    }
+}
+
+void setDepth(int at, int depth) {
+    if (at >= depthCapacity) {
+        int capacity = depthCapacity ? depthCapacity * 2 : 64;
+        while (capacity <= at) {
+            capacity *= 2;
+        }
+        depthAt = arenaGrow(depthAt, depthCapacity * sizeof(int), capacity * sizeof(int));
+        depthCapacity = capacity;
+    }
+    depthAt[at] = depth;
+}
 
-// token list
-TokenPair *tokenList;
-// name table
-char *nameTable;
-// name table count
-int nameCount = 0;
-// token index
-int tx = 0;
-// token
-int token = 0;
-// symbol table index
-int symIdx = 0;
-// lexigraphical level
-int level = 0;
+// reverse text[from..to) in place
+void reverseCode(int from, int to) {
+    for (int i = from, j = to - 1; i < j; i++, j--) {
+        instruction swap = text[i];
+        text[i] = text[j];
+        text[j] = swap;
+    }
+}
 
-// check if word is a reserved word
-int isReservedWord(char* word) {
-    for (int i = 0; i < sizeof(reservedWords) / sizeof(TokenPair); i++) {
-        if (strcmp(word, reservedWords[i].lexeme) == 0) {
-            return reservedWords[i].token;
+// whether text[from..to) is a single LIT, its value in *value
+int isConstant(int from, int to, int *value) {
+    if (to - from == 1 && text[from].OP == 1) {
+        *value = text[from].M;
+        return 1;
+    }
+    return 0;
+}
+
+// whether text[from..to) only computes a value, so dropping it changes
+// nothing else. DIV can fault on a zero divisor at run time
+int isPure(int from, int to) {
+    for (int i = from; i < to; i++) {
+        if (text[i].OP != 1 && text[i].OP != 3 && !(text[i].OP == 2 && text[i].M != 4)) {
+            return 0;
         }
     }
-    return -1;
+    return 1;
 }
 
-// check if symbol is a special symbol
-int isSpecialSymbol(char* symbol) {
-    for (int i = 0; i < sizeof(specialSymbols) / sizeof(TokenPair); i++) {
-        if (strcmp(symbol, specialSymbols[i].lexeme) == 0) {
-            return specialSymbols[i].token;
+// a op b as the vm computes it, 0 if it must be left to run time: division
+// by zero faults there, and INT_MIN / -1 overflows
+int foldOperation(int op, int a, int b, int *result) {
+    switch (op) {
+        case 1:
+            *result = (int)((unsigned)a + (unsigned)b);
+            return 1;
+        case 2:
+            *result = (int)((unsigned)a - (unsigned)b);
+            return 1;
+        case 3:
+            *result = (int)((unsigned)a * (unsigned)b);
+            return 1;
+        case 4:
+            if (b == 0 || (a == INT_MIN && b == -1)) {
+                return 0;
+            }
+            *result = a / b;
+            return 1;
+        case 5:
+            *result = a == b;
+            return 1;
+        case 6:
+            *result = a != b;
+            return 1;
+        case 7:
+            *result = a < b;
+            return 1;
+        case 8:
+            *result = a <= b;
+            return 1;
+        case 9:
+            *result = a > b;
+            return 1;
+        case 10:
+            *result = a >= b;
+            return 1;
+    }
+    return 0;
+}
+
+// instruction index the JMP, JPC or CAL at i goes to, before resolveAddresses
+int jumpTarget(int i) {
+    if (text[i].OP == 5) {
+        return blocks[procs[symbol_table[text[i].M].addr].entry].address;
+    }
+    return blocks[text[i].M].address;
+}
+
+// rewrite local patterns in text[0..cx) until none is left:
+//   load-store  LOD x; STO x stores back what it loaded, both go
+//   jump-next   JMP to the next instruction goes, such as the JMP over an
+//               empty procedure list at the start of every block
+//   jump-chain  a JMP or JPC to a JMP goes straight to its final target
+//   identity    LIT 0; ADD or SUB and LIT 1; MUL or DIV leave the top of
+//               the stack as it was, both go
+// the second instruction of a pair is only touched if nothing jumps to it
+void peephole() {
+    char *removed = arenaAlloc(cx + 1);
+    char *targeted = arenaAlloc(cx + 1);
+    while (peepholePass(removed, targeted)) {
+    }
+}
+
+// one pass of the rules, returns whether anything changed
+int peepholePass(char *removed, char *targeted) {
+    int changed = 0;
+    memset(removed, 0, cx + 1);
+    memset(targeted, 0, cx + 1);
+    for (int i = 0; i < cx; i++) {
+        if (text[i].OP == 5 || text[i].OP == 7 || text[i].OP == 8) {
+            targeted[jumpTarget(i)] = 1;
         }
     }
-    return -1;
+
+    for (int i = 0; i < cx; i++) {
+        if (peepholeEnabled[PEEP_JUMP_CHAIN] && (text[i].OP == 7 || text[i].OP == 8)) {
+            int label = text[i].M;
+            // at most cx steps, a chain may loop
+            for (int steps = 0; steps < cx; steps++) {
+                int t = blocks[label].address;
+                if (t >= cx || text[t].OP != 7 || text[t].M == label) {
+                    break;
+                }
+                label = text[t].M;
+            }
+            if (label != text[i].M) {
+                text[i].M = label;
+                peepholeHits[PEEP_JUMP_CHAIN]++;
+                changed = 1;
+            }
+        }
+        if (peepholeEnabled[PEEP_JUMP_NEXT] && text[i].OP == 7 && jumpTarget(i) == i + 1) {
+            removed[i] = 1;
+            peepholeHits[PEEP_JUMP_NEXT]++;
+            changed = 1;
+            continue;
+        }
+        if (i + 1 >= cx || targeted[i + 1]) {
+            continue;
+        }
+        if (peepholeEnabled[PEEP_LOAD_STORE] && text[i].OP == 3 && text[i + 1].OP == 4 &&
+            text[i].L == text[i + 1].L && text[i].M == text[i + 1].M) {
+            removed[i] = removed[i + 1] = 1;
+            peepholeHits[PEEP_LOAD_STORE]++;
+            changed = 1;
+            i++;
+        } else if (peepholeEnabled[PEEP_IDENTITY] && text[i].OP == 1 && text[i + 1].OP == 2 &&
+                   ((text[i].M == 0 && (text[i + 1].M == 1 || text[i + 1].M == 2)) ||
+                    (text[i].M == 1 && (text[i + 1].M == 3 || text[i + 1].M == 4)))) {
+            removed[i] = removed[i + 1] = 1;
+            peepholeHits[PEEP_IDENTITY]++;
+            changed = 1;
+            i++;
+        }
+    }
+    removeInstructions(removed);
+    return changed;
 }
 
-// emit
-void emit(int op, int L, int M) {
-    if (cx > CODE_SIZE) {
-        printf("Exceeded maximum instruction count\n");
-        exit(1);
-    } else {
-        text[cx].OP = op;
-        text[cx].L = L;
-        text[cx].M = M;
-        cx++;
+// drop the removed instructions. jumps and calls name blocks, so only the
+// block addresses move; a block starting at a removed instruction now
+// starts at the next one kept
+void removeInstructions(const char *removed) {
+    int *newIndex = arenaAlloc((cx + 1) * sizeof(int));
+    int kept = 0;
+    for (int i = 0; i <= cx; i++) {
+        newIndex[i] = kept;
+        if (i < cx && !removed[i]) {
+            kept++;
+        }
+    }
+    for (int i = 0; i < cx; i++) {
+        if (!removed[i]) {
+            text[newIndex[i]] = text[i];
+        }
     }
+    for (int b = 0; b < blockCount; b++) {
+        blocks[b].address = newIndex[blocks[b].address];
+    }
+    cx = kept;
 }
 
 // program
 void program() {
+    addProcedure();
+    startBlock(newBlock());
     token = getNextToken();
     block();
     if (token != periodsym) {
@@ -163,11 +1555,11 @@ void program() {
 }
 
 void block() {
-    int dx, tx0, cx0;
+    int dx, entry;
     dx = 3;
-    tx0=tx-1;
-    symbol_table[tx-1].addr=cx;
-    emit(7, 0, 0); // JMP
+    // JMP over the nested procedures to the body
+    entry = currentBlock;
+    endBlock(7, 0, -1, -1);
 
     if (token == constsym) {
         constDeclaration();
@@ -181,10 +1573,15 @@ void block() {
         procedure();
     }
 
-    text[symbol_table[tx0].addr].M = cx;
-    emit(6, 0, dx); // INC
+    int body = newBlock();
+    blocks[entry].target = body;
+    startBlock(body);
+    procs[currentProc].frame = dx;
+    emit(6, 0, currentProc); // INC, the frame size is resolved at the end
     statement();
-    emit(2, 0, 0); // OPR
+    if (currentProc != 0) {
+        emit(2, 0, 0); // OPR RTN, the main block halts instead
+    }
     exitScope(level);
 }
 
@@ -195,15 +1592,12 @@ void procedure() {
             error(2);
             exit(1);
         }
-        if (symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 1) != -1) {
+        if (symbolTableCheck(lastPayload(), 1) != -1) {
             error(3);
             exit(1);
         }
 
-        char identName[MAX_NAME] = "";
-        strcpy(identName, &nameTable[tokenList[tx-1].index * MAX_NAME]);
-
-        addToSymbolTable(3, identName, 0, level, 0, 0);
+        addToSymbolTable(3, lastPayload(), 0, level, procCount, 0);
 
         token = getNextToken();
 
@@ -213,8 +1607,12 @@ void procedure() {
         }
 
         level++;
+        int outer = currentProc;
+        currentProc = addProcedure();
+        startBlock(newBlock());
         token = getNextToken();
         block();
+        currentProc = outer;
         level--;
 
         if (token != semicolonsym) {
@@ -236,14 +1634,13 @@ void constDeclaration() {
                 error(2);
                 exit(1);
             }
-            if (symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 1) != -1) {
+            if (symbolTableCheck(lastPayload(), 1) != -1) {
                 error(3);
                 exit(1);
             }
             // save identifier name
-            char identName[MAX_NAME] = "";
-            strcpy(identName, &nameTable[tokenList[tx-1].index * MAX_NAME]);
-            
+            int nameIndex = lastPayload();
+
             token = getNextToken();
             if (token != eqlsym) {
                 error(4);
@@ -256,7 +1653,7 @@ void constDeclaration() {
                 exit(1);
             }
 
-            addToSymbolTable(1, identName, tokenList[tx-1].value, level, 0, 0);
+            addToSymbolTable(1, nameIndex, lastPayload(), level, 0, 0);
             token = getNextToken();
     
         } while (token == commasym);
@@ -279,14 +1676,14 @@ int varDeclaration() {
                 error(2);
                 exit(1);
             }
-            int nameIndex = tokenList[tx-1].index;
+            int nameIndex = lastPayload();
 
-            if (symbolTableCheck(&nameTable[nameIndex * MAX_NAME], 1) != -1) {
+            if (symbolTableCheck(nameIndex, 1) != -1) {
                 printSymbolTable(stdout);
                 error(3);
                 exit(1);
             }
-            addToSymbolTable(2, &nameTable[nameIndex * MAX_NAME], 0, level, 2+numVars, 0);
+            addToSymbolTable(2, nameIndex, 0, level, 2+numVars, 0);
             token = getNextToken();
         } while (token == commasym);
 
@@ -301,7 +1698,7 @@ int varDeclaration() {
 
 void statement() {
     if (token == identsym) {
-        int symIdx = symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 0);
+        int symIdx = symbolTableCheck(lastPayload(), 0);
 
         if (symIdx == -1) {
             error(7);
@@ -318,7 +1715,7 @@ void statement() {
         }
         token = getNextToken();
         expression();
-        emit(4, level, symbol_table[symIdx].addr); // STO
+        emit(4, level, symIdx); // STO
         return;
     }
     if (token == callsym) {
@@ -327,13 +1724,13 @@ void statement() {
             error(2);
             exit(1);
         } else {
-            int symIdx = symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 0);
+            int symIdx = symbolTableCheck(lastPayload(), 0);
             if (symIdx == -1) {
                 error(7);
                 exit(1);
             } else {
                 if (symbol_table[symIdx].kind == 3) {
-                    emit(5, level, symbol_table[symIdx].addr); // CAL
+                    emit(5, level, symIdx); // CAL
                 } else {
                     error(8);
                     exit(1);
@@ -358,31 +1755,44 @@ void statement() {
     if (token == ifsym) {
         token = getNextToken();
         condition();
-        int jpcIdx = cx;
-        emit(8, level, 0); // JPC
+        int test = currentBlock;
+        int then = newBlock();
+        endBlock(8, level, -1, then); // JPC
         if (token != thensym) {
             error(11);
             exit(1);
         }
+        startBlock(then);
         token = getNextToken();
         statement();
-        text[jpcIdx].M = cx*3;
+        int join = newBlock();
+        blocks[test].target = join;
+        endBlock(0, 0, -1, join);
+        startBlock(join);
         return;
     }
     if (token == whilesym) {
         token = getNextToken();
-        int loopIdx = cx;
+        int before = currentBlock;
+        int loop = newBlock();
+        endBlock(0, 0, -1, loop);
+        startBlock(loop);
         condition();
         if (token != dosym) {
             error(12);
             exit(1);
         }
         token = getNextToken();
-        int jpcIdx = cx;
-        emit(8, level, 0); // JPC
+        int test = currentBlock;
+        int body = newBlock();
+        endBlock(8, level, -1, body); // JPC
+        startBlock(body);
         statement();
-        emit(7, level, loopIdx); // JMP
-        text[jpcIdx].M = cx*3;
+        endBlock(7, level, loop, -1); // JMP
+        int done = newBlock();
+        blocks[test].target = done;
+        startBlock(done);
+        addLoop(before, loop, done);
         return;
     }
     if (token == readsym) {
@@ -391,7 +1801,7 @@ void statement() {
             error(2);
             exit(1);
         }
-        int symIdx = symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 0);
+        int symIdx = symbolTableCheck(lastPayload(), 0);
         if (symIdx == -1) {
             error(7);
             exit(1);
@@ -402,7 +1812,7 @@ void statement() {
         }
         token = getNextToken();
         emit(9, level, 2); // SYS 2 (Read)
-        emit(4, level, symbol_table[symIdx].addr); // STO
+        emit(4, level, symIdx); // STO
         return;
     }
     if (token == writesym) {
@@ -415,32 +1825,38 @@ void statement() {
 
 // condition
 void condition() {
+    int left = cx;
     if (token == oddsym) {
         token = getNextToken();
         expression();
-        emit(2, level, 11); // ODD
+        emitOperation(11, left, cx); // ODD
     } else {
         expression();
+        int right = cx;
         if (token == eqlsym) {
             token = getNextToken();
             expression();
-            emit(2, level, 5); // EQL
+            emitOperation(5, left, right); // EQL
         } else if (token == neqsym) {
             token = getNextToken();
             expression();
-            emit(2, level, 6); // NEQ
+            emitOperation(6, left, right); // NEQ
         } else if (token == lessym) {
             token = getNextToken();
             expression();
-            emit(2, level, 7); // LSS
+            emitOperation(7, left, right); // LSS
         } else if (token == leqsym) {
             token = getNextToken();
             expression();
-            emit(2, level, 8); // LEQ
+            emitOperation(8, left, right); // LEQ
         } else if (token == gtrsym) {
             token = getNextToken();
             expression();
-            emit(2, level, 9); // GTR
+            emitOperation(9, left, right); // GTR
+        } else if (token == geqsym) {
+            token = getNextToken();
+            expression();
+            emitOperation(10, left, right); // GEQ
         } else {
             error(13);
             exit(1);
@@ -450,32 +1866,36 @@ void condition() {
 
 // expression
 void expression() {
+    int left = cx;
     term();
     while (token == plussym || token == minussym) {
+        int right = cx;
         if (token == plussym) {
             token = getNextToken();
             term();
-            emit(2, level, 1); // ADD
+            emitOperation(1, left, right); // ADD
         } else if (token == minussym) {
             token = getNextToken();
             term();
-            emit(2, level, 2); // SUB
+            emitOperation(2, left, right); // SUB
         }
     }
 }
 
 // term
 void term() {
+    int left = cx;
     factor();
     while (token == multsym || token == slashsym) {
+        int right = cx;
         if (token == multsym) {
             token = getNextToken();
             factor();
-            emit(2, level, 3); // MUL
+            emitOperation(3, left, right); // MUL
         } else if (token == slashsym) {
             token = getNextToken();
             factor();
-            emit(2, level, 4); // DIV
+            emitOperation(4, left, right); // DIV
         }
     }
 }
@@ -483,7 +1903,7 @@ void term() {
 // factor
 void factor() {
     if (token == identsym) {
-        int symIdx = symbolTableCheck(&nameTable[tokenList[tx-1].index * MAX_NAME], 0);
+        int symIdx = symbolTableCheck(lastPayload(), 0);
         if (symIdx == -1) {
             error(7);
             exit(1);
@@ -491,11 +1911,17 @@ void factor() {
         if (symbol_table[symIdx].kind == 1) { // const
             emit(1, level, symbol_table[symIdx].val); // LIT
         } else { // var
-            emit(3, level, symbol_table[symIdx].addr); // LOD
+            emit(3, level, symIdx); // LOD
+        }
+        if (optLevel > 0) {
+            setDepth(cx - 1, 1);
         }
         token = getNextToken();
     } else if (token == numbersym) {
-        emit(1, level, tokenList[tx-1].value); // LIT
+        emit(1, level, lastPayload()); // LIT
+        if (optLevel > 0) {
+            setDepth(cx - 1, 1);
+        }
         token = getNextToken();
     } else if (token == lparentsym) {
         token = getNextToken();
@@ -512,175 +1938,336 @@ void factor() {
 }
 
 
-// get next token
+// get next token, scanned on demand
 int getNextToken() {
-    return tokenList[tx++].token;
+    int slot = tx++ & (LOOKAHEAD - 1);
+    tokenKind[slot] = scanToken(&tokenPayload[slot]);
+    tokenOffset[slot] = scanStart - scanSource;
+    return tokenKind[slot];
 }
 
-// symbol table check
-int symbolTableCheck(char* name, int checkCurrentScopeOnly) {
-    for (int i = symbolTableSize; i >= 0; i--) {
-        if (strcmp(name, symbol_table[i].name) == 0 && symbol_table[i].mark == 0) {
-            if (checkCurrentScopeOnly && symbol_table[i].level != level) {
-                continue;
-            }
-            return i;
-        }
+// name id or value of the token getNextToken returned last
+int lastPayload() {
+    return tokenPayload[(tx - 1) & (LOOKAHEAD - 1)];
+}
+
+// make sure visible[] covers every name id interned so far
+void growVisible() {
+    if (visibleSize >= nameCount) {
+        return;
     }
-    return -1;
+    int size = visibleSize ? visibleSize : 256;
+    while (size < nameCount) {
+        size *= 2;
+    }
+    visible = arenaGrow(visible, visibleSize * sizeof(int), size * sizeof(int));
+    for (int i = visibleSize; i < size; i++) {
+        visible[i] = -1;
+    }
+    visibleSize = size;
+}
+
+// symbol table check, the innermost visible symbol named name
+int symbolTableCheck(int name, int checkCurrentScopeOnly) {
+    growVisible();
+    int i = visible[name];
+    if (i == -1 || (checkCurrentScopeOnly && symbol_table[i].level != level)) {
+        return -1;
+    }
+    return i;
 }
 
+// pop the scope's declarations off the undo log, uncovering what they hid
 void exitScope(int level) {
-    for (int i = 0; i < symbolTableSize; i++) {
-        if (symbol_table[i].level == level) {
-            symbol_table[i].mark = 1;
-        }
+    while (scopeLogSize > 0 && symbol_table[scopeLog[scopeLogSize - 1]].level == level) {
+        symbol *s = &symbol_table[scopeLog[--scopeLogSize]];
+        s->mark = 1;
+        visible[s->name] = s->shadowed;
     }
 }
 
-void addToSymbolTable(int kind, char *name, int val, int level, int addr, int mark) {
-    if (symbolTableSize >= MAX_SYMBOL_TABLE_SIZE) {
-        printf("Error: Symbol table full\n");
+void growSymbolTable() {
+    if (symbolTableSize == symbolTableCapacity) {
+        int capacity = symbolTableCapacity ? symbolTableCapacity * 2 : 64;
+        symbol_table = arenaGrow(symbol_table, symbolTableCapacity * sizeof(symbol), capacity * sizeof(symbol));
+        scopeLog = arenaGrow(scopeLog, symbolTableCapacity * sizeof(int), capacity * sizeof(int));
+        symbolTableCapacity = capacity;
     }
+}
+
+// a new frame slot in procedure proc for a compiler temporary: a variable
+// with no name, never visible to lookups
+int addTemporary(int proc) {
+    growSymbolTable();
+    symbol *s = &symbol_table[symbolTableSize];
+    s->kind = 2;
+    s->name = -1;
+    s->val = 0;
+    s->level = procs[proc].level;
+    s->addr = procs[proc].frame++;
+    s->mark = 1;
+    s->shadowed = -1;
+    s->proc = proc;
+    return symbolTableSize++;
+}
+
+void addToSymbolTable(int kind, int name, int val, int level, int addr, int mark) {
+    growSymbolTable();
+    growVisible();
     symbol s;
     s.kind = kind;
-    strncpy(s.name, name, MAX_NAME);
+    s.name = name;
     s.val = val;
     s.level = level;
     s.addr = addr;
     s.mark = mark;
+    s.shadowed = visible[name];
+    s.proc = currentProc;
 
+    visible[name] = symbolTableSize;
+    scopeLog[scopeLogSize++] = symbolTableSize;
     symbol_table[symbolTableSize++] = s;
 }
 
-// lexical analyzer
-void lexicalAnalyzer(char* source, int *size, FILE* outputFile) {
-    // initialize variables
-    int i = 0, j, k = 0;
-    char word[MAX_NAME], symbol[3];
-    int inComment = 0;
-    
-    // loop through source array
-    while (i < strlen(source)) {
-        // check for comments
-        if (source[i] == '/' && source[i+1] == '*') {
-            inComment = 1;
-            i += 2;
-            continue; 
-        } else if (source[i] == '*' && source[i+1] == '/' && inComment == 1) {
-            inComment = 0;
-            i += 2;
-            continue; 
-        }
-
-        if (inComment) {
-            i++;
-            continue;
+// character classes, one table lookup decides what a token can be
+enum { CC_OTHER, CC_SPACE, CC_LETTER, CC_DIGIT, CC_SYMBOL, CC_END };
+unsigned char charClass[256];
+// operator transitions: opToken[c] is the one-character operator c, and
+// opPair[opLead[c]][d] the two-character operator cd (0 if none). only
+// ':', '<' and '>' start two-character operators
+unsigned char opToken[256];
+signed char opLead[256];
+unsigned char opPair[3][256];
+
+// build the scanner tables from reservedWords and specialSymbols
+void initScanner() {
+    for (int c = 0; c < 256; c++) {
+        charClass[c] = CC_OTHER;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        charClass[c] = CC_LETTER;
+        charClass[c - 'a' + 'A'] = CC_LETTER;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        charClass[c] = CC_DIGIT;
+    }
+    for (const char *c = " \t\n\v\f\r"; *c; c++) {
+        charClass[(unsigned char)*c] = CC_SPACE;
+    }
+    for (const char *c = "+-*/()=,.;:<>"; *c; c++) {
+        charClass[(unsigned char)*c] = CC_SYMBOL;
+    }
+    charClass['\0'] = CC_END; // the source ends at its first null, as with strlen
+
+    for (int i = 0; i < 16; i++) {
+        keywordSlot[i] = -1;
+    }
+    for (int i = 0; i < sizeof(reservedWords) / sizeof(TokenPair); i++) {
+        keywordSlot[keywordHash(reservedWords[i].lexeme, strlen(reservedWords[i].lexeme))] = i;
+    }
+
+    memset(opToken, 0, sizeof(opToken));
+    memset(opLead, -1, sizeof(opLead));
+    memset(opPair, 0, sizeof(opPair));
+    int leads = 0;
+    for (int i = 0; i < sizeof(specialSymbols) / sizeof(TokenPair); i++) {
+        unsigned char c = specialSymbols[i].lexeme[0], d = specialSymbols[i].lexeme[1];
+        if (d == '\0') {
+            opToken[c] = specialSymbols[i].token;
+        } else {
+            if (opLead[c] < 0) {
+                opLead[c] = leads++;
+            }
+            opPair[opLead[c]][d] = specialSymbols[i].token;
         }
+    }
+}
 
-        // check for whitespace 
-        if (isspace(source[i])) {
-            i++;
-            continue;
+// whether skipSpace and skipComment use their vector loops, -bench turns
+// it off to time the scalar path on the same input
+int vectorScan = 1;
+
+// first byte at or after p that is not whitespace. the vector loops test
+// 32 or 16 bytes at a time: ' ', or '\t'..'\r' as c - '\t' <= 4 unsigned.
+// single separating spaces are the common case and stay scalar
+const char* skipSpace(const char* p, const char* end) {
+    if (p + 1 < end && charClass[(unsigned char)p[1]] != CC_SPACE) {
+        return p + 1;
+    }
+#ifdef __AVX2__
+    const __m256i space32 = _mm256_set1_epi8(' '), tab32 = _mm256_set1_epi8('\t'), four32 = _mm256_set1_epi8(4);
+    while (vectorScan && end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        __m256i d = _mm256_sub_epi8(c, tab32);
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(c, space32), _mm256_cmpeq_epi8(_mm256_min_epu8(d, four32), d));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(ws);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i space16 = _mm_set1_epi8(' '), tab16 = _mm_set1_epi8('\t'), four16 = _mm_set1_epi8(4);
+    while (vectorScan && end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        __m128i d = _mm_sub_epi8(c, tab16);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(c, space16), _mm_cmpeq_epi8(_mm_min_epu8(d, four16), d));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(ws) & 0xffff;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && charClass[(unsigned char)*p] == CC_SPACE) {
+        p++;
+    }
+    return p;
+}
+
+// first '*', '/' or null at or after p, the only bytes that matter inside
+// a comment
+const char* skipComment(const char* p, const char* end) {
+#ifdef __AVX2__
+    const __m256i star32 = _mm256_set1_epi8('*'), slash32 = _mm256_set1_epi8('/'), zero32 = _mm256_setzero_si256();
+    while (vectorScan && end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, star32), _mm256_cmpeq_epi8(c, slash32)),
+                                      _mm256_cmpeq_epi8(c, zero32));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i star16 = _mm_set1_epi8('*'), slash16 = _mm_set1_epi8('/'), zero16 = _mm_setzero_si128();
+    while (vectorScan && end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, star16), _mm_cmpeq_epi8(c, slash16)),
+                                   _mm_cmpeq_epi8(c, zero16));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
         }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '*' && *p != '/' && *p != '\0') {
+        p++;
+    }
+    return p;
+}
+
+// point the scanner at source[0..length)
+void startScanner(const char* source, int length, FILE* outputFile) {
+    scanSource = source;
+    scanPos = source;
+    scanEnd = source + length;
+    scanOutput = outputFile;
+}
 
-        // check letter
-        if (isalpha(source[i])) {
-            j = 0;
-            int errorPrinted = 0;
-            // scan in word
-            while (i < strlen(source) && (isalpha(source[i])) || isdigit(source[i])) {
-                if (j < MAX_NAME-1) {
-                    word[j++] = source[i++];
-                } else { // if too long
-                    printf("%s...\t", word);
+// scan the next token and return its kind, 0 at the end of the source. the
+// name id or number value goes in *payload
+int scanToken(int *payload) {
+    const char *p = scanPos, *end = scanEnd, *at = p;
+    int kind = 0;
+
+    while (p < end && kind == 0) {
+        at = p;
+        switch (charClass[(unsigned char)*p]) {
+            case CC_SPACE:
+                p = skipSpace(p, end);
+                break;
+
+            case CC_LETTER: {
+                const char *start = p;
+                while (p < end && (charClass[(unsigned char)*p] == CC_LETTER || charClass[(unsigned char)*p] == CC_DIGIT)) {
+                    p++;
+                }
+                int len = p - start;
+                if (len > MAX_NAME - 1) { // if too long
+                    printf("%.*s...\t", MAX_NAME - 1, start);
                     printf("Error: Name too long.\n");
-                    fprintf(outputFile, "%s...\t\t", word);
-                    fprintf(outputFile, "Error: Name too long.\n");
+                    fprintf(scanOutput, "%.*s...\t\t", MAX_NAME - 1, start);
+                    fprintf(scanOutput, "Error: Name too long.\n");
                     exit(1);
-                    errorPrinted = 1;
-                    // skip to next whitespace
-                    while (i < strlen(source) && isalpha(source[i] || isdigit(source[i]))) {
-                        i++;
-                    }
-                    break;
                 }
-            }
-            word[j] = '\0'; // null terminator
-
-            int token = isReservedWord(word); 
-            if (!errorPrinted) {
+                int token = isReservedWord(start, len);
                 if (token != -1) { // if reserved word
-                    tokenList[k].token = token;
-                    k++;
+                    kind = token;
                 } else { // if identifier
-                    tokenList[k].token = identsym;
-                    int index = addName(word);
-                    tokenList[k].index = index;
-                    k++;
+                    kind = identsym;
+                    *payload = addName(start, len);
                 }
+                break;
             }
-        } else if (isdigit(source[i])) { // check number
-            j = 0;
-            int errorPrinted = 0;
-            // scan in number
-            while (isdigit(source[i])) {
-                if (j < MAX_NUM) {
-                    word[j++] = source[i++];
-                } else { // if too long
-                    printf("%s...\t", word);
-                    printf("Error: Number too long.\n");
-                    fprintf(outputFile, "%s...\t\t", word);
-                    fprintf(outputFile, "Error: Number too long.\n");
-                    exit(1);
-                    errorPrinted = 1;
-                    // skip to next whitespace
-                    while (i < strlen(source) && isdigit(source[i])) {
-                        i++;
+
+            case CC_DIGIT: {
+                const char *start = p;
+                int value = 0;
+                while (p < end && charClass[(unsigned char)*p] == CC_DIGIT) {
+                    if (p - start == MAX_NUM) { // if too long
+                        printf("%.*s...\t", MAX_NUM, start);
+                        printf("Error: Number too long.\n");
+                        fprintf(scanOutput, "%.*s...\t\t", MAX_NUM, start);
+                        fprintf(scanOutput, "Error: Number too long.\n");
+                        exit(1);
                     }
-                    break;
+                    value = value * 10 + (*p++ - '0');
                 }
+                kind = numbersym;
+                *payload = value;
+                break;
             }
-            word[j] = '\0'; // null terminator
-
-            if (!errorPrinted) {
-                tokenList[k].token = numbersym;
-                tokenList[k].value = atoi(word);                
-                k++;
-            }
-        } else { // else check special symbol
-            symbol[0] = source[i];
-            // check for special symbol w 2 characters
-            if (i+1 < strlen(source)) {
-                symbol[1] = source[i+1];
-            } else { // if only 1 character
-                symbol[1] = '\0';
-            }
-            symbol[2] = '\0'; // null terminator
-
-            // check if special symbol
-            int token = isSpecialSymbol(symbol);
-            if (token != -1) { // if special symbol
-                tokenList[k++].token = token;
-                i += 2;
-            } else { // if not special symbol
-                symbol[1] = '\0';
-                token = isSpecialSymbol(symbol);
-                if (token != -1) {
-                    tokenList[k++].token = token;
-                    i++;
-                } else { // if non supported symbol
-                    printf("%s\t\t", symbol);
-                    printf("Error: Invalid symbol.\n");
-                    fprintf(outputFile, "%s\t\t\t", symbol);
-                    fprintf(outputFile, "Error: Invalid symbol.\n");
-                    exit(1);
-                    i++;
+
+            case CC_SYMBOL: {
+                char next = p + 1 < end ? p[1] : '\0';
+                // comment, ends at the first */ not part of a nested /*
+                if (p[0] == '/' && next == '*') {
+                    p += 2;
+                    while ((p = skipComment(p, end)) < end && *p != '\0') {
+                        if (p[0] == '*' && p + 1 < end && p[1] == '/') {
+                            p += 2;
+                            break;
+                        }
+                        p += (p[0] == '/' && p + 1 < end && p[1] == '*') ? 2 : 1;
+                    }
+                    break;
+                }
+                // two-character operator, else one-character
+                int lead = opLead[(unsigned char)p[0]];
+                if (lead >= 0 && opPair[lead][(unsigned char)next] != 0) {
+                    kind = opPair[lead][(unsigned char)next];
+                    p += 2;
+                    break;
+                }
+                if (opToken[(unsigned char)p[0]] != 0) {
+                    kind = opToken[(unsigned char)p[0]];
+                    p++;
+                    break;
                 }
-            } 
+                // fall through to invalid symbol
+            }
+
+            case CC_OTHER:
+                printf("%c\t\t", *p);
+                printf("Error: Invalid symbol.\n");
+                fprintf(scanOutput, "%c\t\t\t", *p);
+                fprintf(scanOutput, "Error: Invalid symbol.\n");
+                exit(1);
+
+            case CC_END:
+                end = p;
+                scanEnd = p;
+                break;
         }
-        *size = k;
     }
+    scanPos = p;
+    scanStart = at;
+    return kind;
 }
 
 void error(int i) {
@@ -732,6 +2319,40 @@ void error(int i) {
             printf("arithmetic equations must contain operands, parentheses, numbers, or symbols\n");
             break;
     }
+    printErrorLine();
+}
+
+// what -O did to the program
+void printOptimizationReport() {
+    printf("\nOptimizations\n");
+    printf("constant folding: %d instructions saved, %d branches on constants\n", foldSaved, branchesFolded);
+    printf("inlining: %d calls to %d procedures inlined\n", callsInlined, procsInlined);
+    printf("dead code: %d blocks, %d procedures, %d variable slots removed\n", deadBlocks, deadProcs, deadSlots);
+    printf("loop-invariant code motion: %d expressions hoisted from %d loops, %d instructions out of loop bodies\n",
+           hoisted, hoistedLoops, hoistSaved);
+    printf("loop rotation: %d loops test at the bottom\n", loopsRotated);
+    printf("common subexpressions: %d reused, %d instructions saved\n", valuesReused, reuseSaved);
+    printf("operand reordering: %d operations evaluate their deeper operand first\n", operandsSwapped);
+    for (int i = 0; i < PEEP_RULES; i++) {
+        printf("peephole %s: %d%s\n", peepholeNames[i], peepholeHits[i], peepholeEnabled[i] ? "" : " (off)");
+    }
+}
+
+// print the number and text of the source line holding the current token
+void printErrorLine() {
+    const char *at = scanSource + tokenOffset[(tx - 1) & (LOOKAHEAD - 1)];
+    const char *lineStart = at, *lineEnd = at;
+    int line = 1;
+    for (const char *p = scanSource; p < at; p++) {
+        if (*p == '\n') {
+            line++;
+            lineStart = p + 1;
+        }
+    }
+    while (lineEnd < scanEnd && *lineEnd != '\n') {
+        lineEnd++;
+    }
+    printf("line %d: %.*s\n", line, (int)(lineEnd - lineStart), lineStart);
 }
 
 void printSymbolTable(FILE* outputFile) {
@@ -740,7 +2361,7 @@ void printSymbolTable(FILE* outputFile) {
     for (int i = 0; i < symbolTableSize; i++) {
         printf("%-4d | %-20s | %-6d | %-5d | %-7d | %-4d\n",
                symbol_table[i].kind,
-               symbol_table[i].name,
+               nameOf(symbol_table[i].name),
                symbol_table[i].val,
                symbol_table[i].level,
                symbol_table[i].addr,
@@ -748,59 +2369,410 @@ void printSymbolTable(FILE* outputFile) {
     }
 }
 
-int addName(char* name) {
-    for (int i = 0; i < nameCount; i++) {
-        if (strcmp(&nameTable[i * MAX_NAME], name) == 0) {
-            return i;
+void initNames() {
+    nameCapacity = 256;
+    nameText = arenaAlloc(nameCapacity * sizeof(char*));
+    nameHash = arenaAlloc(nameCapacity * sizeof(unsigned));
+    nameCount = 0;
+    slotCount = 512;
+    nameSlots = arenaAlloc(slotCount * sizeof(int));
+    memset(nameSlots, 0, slotCount * sizeof(int));
+}
+
+// allocate bytes from the arena, 8-byte aligned, starting a new chunk
+// when the current one is full
+void* arenaAlloc(size_t bytes) {
+    bytes = (bytes + 7) & ~(size_t)7;
+    if (arena == NULL || arena->used + bytes > arena->size) {
+        size_t size = arena ? arena->size * 2 : ARENA_CHUNK;
+        while (size < bytes) {
+            size *= 2;
+        }
+        ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+        if (chunk == NULL) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        chunk->next = arena;
+        chunk->size = size;
+        chunk->used = 0;
+        arena = chunk;
+    }
+    void *p = arena->data + arena->used;
+    arena->used += bytes;
+    return p;
+}
+
+// grow an arena block from oldBytes to newBytes, in place when it was the
+// last allocation and its chunk has room, else by copying to a new block
+void* arenaGrow(void* old, size_t oldBytes, size_t newBytes) {
+    size_t oldRounded = (oldBytes + 7) & ~(size_t)7;
+    size_t newRounded = (newBytes + 7) & ~(size_t)7;
+    if (old != NULL && arena != NULL && (char*)old + oldRounded == arena->data + arena->used &&
+        arena->used - oldRounded + newRounded <= arena->size) {
+        arena->used = arena->used - oldRounded + newRounded;
+        return old;
+    }
+    void *p = arenaAlloc(newBytes);
+    if (old != NULL) {
+        memcpy(p, old, oldBytes);
+    }
+    return p;
+}
+
+// release every allocation, keeping the newest (largest) chunk for reuse
+void arenaReset() {
+    while (arena != NULL && arena->next != NULL) {
+        ArenaChunk *older = arena->next;
+        arena->next = older->next;
+        free(older);
+    }
+    if (arena != NULL) {
+        arena->used = 0;
+    }
+}
+
+// start a fresh compile: empty arena, names, symbol table and code
+void resetCompiler() {
+    arenaReset();
+    initNames();
+    symbol_table = NULL;
+    symbolTableSize = 0;
+    symbolTableCapacity = 0;
+    visible = NULL;
+    visibleSize = 0;
+    scopeLog = NULL;
+    scopeLogSize = 0;
+    text = NULL;
+    codeCapacity = 0;
+    cx = 0;
+    blocks = NULL;
+    blockCount = 0;
+    blockCapacity = 0;
+    currentBlock = -1;
+    currentProc = 0;
+    procCount = 0;
+    procs = NULL;
+    procCapacity = 0;
+    loops = NULL;
+    loopCount = 0;
+    loopCapacity = 0;
+    depthAt = NULL;
+    depthCapacity = 0;
+    tx = 0;
+    token = 0;
+    level = 0;
+}
+
+// FNV-1a
+unsigned hashName(const char* name, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// intern name[0..len) and return its id, the same id for the same text
+int addName(const char* name, int len) {
+    unsigned h = hashName(name, len);
+    int mask = slotCount - 1;
+    int i = h & mask;
+    while (nameSlots[i] != 0) {
+        int id = nameSlots[i] - 1;
+        if (nameHash[id] == h && strncmp(nameText[id], name, len) == 0 && nameText[id][len] == '\0') {
+            return id;
         }
+        i = (i + 1) & mask;
+    }
+
+    // new name, copy its text into the arena
+    if (nameCount == nameCapacity) {
+        nameText = arenaGrow(nameText, nameCapacity * sizeof(char*), nameCapacity * 2 * sizeof(char*));
+        nameHash = arenaGrow(nameHash, nameCapacity * sizeof(unsigned), nameCapacity * 2 * sizeof(unsigned));
+        nameCapacity *= 2;
     }
-    strcpy(&nameTable[nameCount * MAX_NAME], name);
+    char *copy = arenaAlloc(len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    nameText[nameCount] = copy;
+    nameHash[nameCount] = h;
+    nameSlots[i] = nameCount + 1;
     nameCount++;
+
+    // keep the table at most half full, rehashing from the stored hashes
+    if (nameCount * 2 > slotCount) {
+        slotCount *= 2;
+        nameSlots = arenaAlloc(slotCount * sizeof(int));
+        memset(nameSlots, 0, slotCount * sizeof(int));
+        mask = slotCount - 1;
+        for (int id = 0; id < nameCount; id++) {
+            i = nameHash[id] & mask;
+            while (nameSlots[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            nameSlots[i] = id + 1;
+        }
+    }
     return nameCount-1;
 }
 
+// text of an interned name, valid until the arena is reset
+char* nameOf(int id) {
+    return nameText[id];
+}
+
 
-int main(int argc, char** argv) {
-    // allocate memory
-    char *source = malloc(MAX_LEN * sizeof(char));
-    tokenList = malloc(MAX_LEN * sizeof(TokenPair));
-    nameTable = malloc(MAX_LEN * MAX_NAME * sizeof(char));
+// print the token stream, one token per line with its name id or value
+void printTokenList() {
+    int kind, payload;
+    while ((kind = scanToken(&payload)) != 0) {
+        if (kind == identsym || kind == numbersym) {
+            printf("%d %d\n", kind, payload);
+        } else {
+            printf("%d\n", kind);
+        }
+    }
+}
+
+// map the source file read-only, or read it in one go when it cannot be
+// mapped (pipes, empty files). the view is not null terminated. returns
+// NULL if the file cannot be opened
+char* loadSource(const char* filename, size_t *length, int *mapped) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (source != MAP_FAILED) {
+            madvise(source, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *length = st.st_size;
+            *mapped = 1;
+            return source;
+        }
+    }
+
+    // bulk read into the arena, doubling the buffer
+    size_t size = MAX_LEN, used = 0;
+    char *source = arenaAlloc(size);
+    ssize_t n;
+    while ((n = read(fd, source + used, size - used)) > 0) {
+        used += n;
+        if (used == size) {
+            source = arenaGrow(source, size, size * 2);
+            size *= 2;
+        }
+    }
+    close(fd);
+    *length = used;
+    *mapped = 0;
+    return source;
+}
+
+// unmap a mapped source, a read one goes with the arena
+void freeSource(char* source, size_t length, int mapped) {
+    if (mapped) {
+        munmap(source, length);
+    }
+}
+
+// about mb megabytes of chunk repeated, null terminated
+char* repeatChunk(const char* chunk, int mb, size_t *length) {
+    size_t chunkLen = strlen(chunk);
+    *length = (size_t)mb * 1024 * 1024 / chunkLen * chunkLen;
+    char *source = malloc(*length + 1);
+    for (size_t i = 0; i < *length; i += chunkLen) {
+        memcpy(source + i, chunk, chunkLen);
+    }
+    source[*length] = '\0';
+    return source;
+}
+
+// scan all of source, return the seconds taken and the token count in *size
+double timeScanner(const char* source, size_t length, int *size, FILE* devNull) {
+    struct timespec start, stop;
+    int payload;
+    *size = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    startScanner(source, length, devNull);
+    while (scanToken(&payload) != 0) {
+        (*size)++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// time the vector and scalar skipping paths on the same source
+void compareSkipping(const char* what, const char* source, size_t length, FILE* devNull) {
     int size = 0;
-    FILE* fp = fopen(argv[1], "r"); // open file
-    FILE* outputFile = fopen("elf.txt", "w"); // open output file
+    double mb = length / (1024.0 * 1024.0);
+    double vector = timeScanner(source, length, &size, devNull);
+    vectorScan = 0;
+    double scalar = timeScanner(source, length, &size, devNull);
+    vectorScan = 1;
+    printf("%s: %.1f MB, %d tokens, vector %.1f MB/s, scalar %.1f MB/s\n",
+           what, mb, size, mb / vector, mb / scalar);
+}
+
+// generate about mb megabytes of declarations and statements over a small
+// set of names and time the lexer on it
+int lexerBenchmark(int mb) {
+    const char *chunk =
+        "var alpha, beta, gamma9, delta;\n"
+        "procedure step;\n"
+        "    begin\n"
+        "        alpha := alpha + beta * 12 - (gamma9 / 3);\n"
+        "        if alpha >= 100 then delta := delta - 1;\n"
+        "        while beta <> 0 do beta := beta - 1;\n"
+        "        /* keep going */ call step; write alpha; read gamma9\n"
+        "    end;\n";
+    size_t length = 0;
+    char *source = repeatChunk(chunk, mb, &length);
+
+    initScanner();
+    resetCompiler();
+    FILE *devNull = fopen("/dev/null", "w");
+    int size = 0;
+
+    double seconds = timeScanner(source, length, &size, devNull);
+    printf("lexer: %.1f MB, %d tokens in %.3f ms, %.1f MB/s\n",
+           length / (1024.0 * 1024.0), size, seconds * 1e3, length / (1024.0 * 1024.0) / seconds);
+    free(source);
+
+    // generated code: block comments and deep indentation
+    const char *commented =
+        "/*\n"
+        " * step the counters once, generated for unit 42 of the model.\n"
+        " * inputs: alpha, beta. outputs: gamma9, delta. no side effects\n"
+        " * beyond the four globals, safe to call from any procedure.\n"
+        " */\n"
+        "                        begin\n"
+        "                            alpha := alpha + 1; /* next row */\n"
+        "                            delta := delta - beta\n"
+        "                        end;\n";
+    source = repeatChunk(commented, mb, &length);
+    compareSkipping("comments", source, length, devNull);
+    free(source);
+
+    // interning: every identifier distinct
+    int unique = 300000;
+    source = malloc(unique * 9 + 1);
+    length = 0;
+    for (int i = 0; i < unique; i++) {
+        length += sprintf(source + length, "n%d ", i);
+    }
+    resetCompiler();
+    seconds = timeScanner(source, length, &size, devNull);
+    printf("names: %d unique identifiers interned in %.3f ms\n", nameCount, seconds * 1e3);
+    free(source);
+
+    // back-to-back compiles, each one reset of the arena
+    const char *small =
+        "const limit = 10; var i, total;\n"
+        "procedure add; var step; begin step := i * 2; total := total + step end;\n"
+        "begin i := 0; total := 0; while i < limit do begin call add; i := i + 1 end; write total end.\n";
+    int compiles = 100000;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < compiles; i++) {
+        resetCompiler();
+        startScanner(small, strlen(small), devNull);
+        program();
+        lowerProgram();
+        resolveAddresses();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("compiles: %d programs of %d instructions in %.3f ms, %.2f us each\n",
+           compiles, cx, seconds * 1e3, seconds * 1e6 / compiles);
+
+    fclose(devNull);
+    arenaReset();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    char *filename = NULL;
+    int printTokens = 0;
+    int showIR = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-tokens") == 0) {
+            printTokens = 1;
+        } else if (strcmp(argv[i], "-ir") == 0) {
+            showIR = 1;
+        } else if (strcmp(argv[i], "-bench") == 0) {
+            return lexerBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 16);
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optLevel = 1;
+        } else if (strcmp(argv[i], "-nopeep") == 0 && i + 1 < argc) {
+            int rule = 0;
+            while (rule < PEEP_RULES && strcmp(argv[i + 1], peepholeNames[rule]) != 0) {
+                rule++;
+            }
+            if (rule == PEEP_RULES) {
+                printf("Error: unknown peephole rule %s\n", argv[i + 1]);
+                return 1;
+            }
+            peepholeEnabled[rule] = 0;
+            i++;
+        } else if (strcmp(argv[i], "-maxcode") == 0 && i + 1 < argc) {
+            maxCode = atoi(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("Usage: compiler [-tokens] [-ir] [-O [-nopeep <rule>]] [-maxcode <instructions>] <source> | -bench [MB]\n");
+        return 1;
+    }
+    initScanner();
+    resetCompiler();
+
+    // map the source
+    size_t size = 0;
+    int mapped = 0;
+    char *source = loadSource(filename, &size, &mapped);
 
     // error handling file opening
-    if (fp == NULL) {
+    if (source == NULL) {
         printf("Error: File not found\n");
-        free(source);
-        free(tokenList);
-        free(nameTable);
         return 1;
     }
-    // initialize variables
-    int i = 0;
-    char c;
-    int bufferSize = MAX_LEN;
-    // scan file into source array
-    while ((c = fgetc(fp)) != EOF) {
-        if (i >= bufferSize - 1) {
-            bufferSize *= 2;
-            source = realloc(source, bufferSize);
-        }
-        source[i++] = c;
-    }
-    source[i] = '\0'; // null terminater
-    fclose(fp); // close file
+    FILE* outputFile = fopen("elf.txt", "w"); // open output file
+
+    // the program text ends at the first null byte, if any
+    char *nul = memchr(source, '\0', size);
+    size_t length = nul != NULL ? nul - source : size;
+
+    // the parser pulls tokens from the scanner as it goes
+    startScanner(source, length, outputFile);
 
-    // run lexical analyzer
-    lexicalAnalyzer(source, &size, outputFile);
+    if (printTokens) {
+        printTokenList();
+        return 0;
+    }
 
     // print input program
-    printf("%s\n", source);
+    fwrite(source, 1, length, stdout);
+    printf("\n");
     printf("\n");
 
-    token = tokenList[0].token;
     program();
+    if (optLevel > 0) {
+        optimizeProgram();
+    }
+    if (showIR) {
+        printIR();
+    }
+    lowerProgram();
+    if (optLevel > 0) {
+        peephole();
+    }
+    resolveAddresses();
 
     printf("No errors, program is syntactically correct.\n");
 
@@ -832,12 +2804,15 @@ int main(int argc, char** argv) {
     }
 
 
+    if (optLevel > 0) {
+        printOptimizationReport();
+    }
+
     fclose(outputFile); // close output file
 
     // free memory
-    free(source);
-    free(tokenList);
-    free(nameTable);
+    freeSource(source, size, mapped);
+    arenaReset();
     return 0;
 }
                
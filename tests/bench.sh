@@ -0,0 +1,30 @@
+#!/bin/sh
+# run-time cost of the generated code: for every program in tests/ and
+# tests/bench/, the instructions it compiles to, the instructions the vm
+# executes and its peak stack depth in words (vm -cache <dir> -stats),
+# without and with -O. input is tests/input.txt
+#
+# usage: tests/bench.sh
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cc=${CC:-gcc}
+$cc -O2 -o "$work/compiler" "$tests/../compiler.c" || exit 1
+$cc -O2 -o "$work/vm" "$tests/../vm.c" -pthread || exit 1
+cd "$work"
+
+# compile $1 with flags $2 and print code size, executed instructions and
+# peak stack
+measure() {
+    ./compiler $2 "$1" > /dev/null || exit 1
+    rm -rf cache
+    stats=$(./vm -q -cache cache -stats elf.txt < "$tests/input.txt" 2>&1 >/dev/null | head -1)
+    echo "$(wc -l < elf.txt) $(echo "$stats" | sed 's/cache miss: \([0-9]*\) instructions, peak stack \([0-9]*\) words/\1 \2/')"
+}
+
+printf "%-20s %8s %8s %10s %10s %6s %6s\n" "" "code" "" "executed" "" "stack" ""
+printf "%-20s %8s %8s %10s %10s %6s %6s\n" "program" "plain" "-O" "plain" "-O" "plain" "-O"
+for source in "$tests"/*.pl0 "$tests"/bench/*.pl0; do
+    set -- $(measure "$source" "") $(measure "$source" -O)
+    printf "%-20s %8d %8d %10d %10d %6d %6d\n" "$(basename "$source" .pl0)" "$1" "$4" "$2" "$5" "$3" "$6"
+done
@@ -0,0 +1,249 @@
+// random PL/0 program generator for the differential test (run.sh -fuzz)
+// usage: genprog <seed>
+// every program terminates: while loops count a variable nothing else
+// stores to up to a small bound, and a procedure only calls procedures
+// declared before it that are not its ancestors, so nothing recurses
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_SCOPE 32
+
+// names visible at each nesting depth of the program being generated
+typedef struct {
+    char vars[8][8];
+    int varCount;
+    char procs[8][8];
+    int procCount;
+    int loops; // loop counters declared in this scope
+} scope;
+
+scope scopes[MAX_SCOPE];
+int depth = 0;
+int procNumber = 0;
+int varNumber = 0;
+
+int pick(int n) {
+    return rand() % n;
+}
+
+void indent(int n) {
+    for (int i = 0; i < n; i++) {
+        printf("    ");
+    }
+}
+
+// any variable visible here, loop counters included
+void variable(int readable) {
+    int total = 0;
+    for (int d = 0; d <= depth; d++) {
+        total += scopes[d].varCount + (readable ? scopes[d].loops : 0);
+    }
+    int k = pick(total);
+    for (int d = 0; d <= depth; d++) {
+        if (k < scopes[d].varCount) {
+            printf("%s", scopes[d].vars[k]);
+            return;
+        }
+        k -= scopes[d].varCount;
+        if (readable) {
+            if (k < scopes[d].loops) {
+                printf("l%d%d", d, k);
+                return;
+            }
+            k -= scopes[d].loops;
+        }
+    }
+}
+
+void expression(int size);
+
+void factor(int size) {
+    int choice = size <= 0 ? pick(2) : pick(4);
+    if (choice == 0) {
+        variable(1);
+    } else if (choice == 1) {
+        printf("%d", pick(4) == 0 ? pick(100000) : pick(10));
+    } else {
+        printf("(");
+        expression(size - 1);
+        printf(")");
+    }
+}
+
+void term(int size) {
+    factor(size - 1);
+    for (int n = pick(3); n > 0; n--) {
+        // mostly by a nonzero constant, or most programs would end in a
+        // division by zero before doing much
+        if (pick(6) != 0) {
+            printf(" * ");
+            factor(size - 1);
+        } else if (pick(4) != 0) {
+            printf(" / %d", 1 + pick(9));
+        } else {
+            printf(" / ");
+            factor(size - 1);
+        }
+    }
+}
+
+void expression(int size) {
+    term(size - 1);
+    for (int n = pick(3); n > 0; n--) {
+        printf(pick(2) ? " + " : " - ");
+        term(size - 1);
+    }
+}
+
+void condition() {
+    static const char *operators[] = { "=", "<>", "<", "<=", ">", ">=" };
+    if (pick(6) == 0) {
+        printf("odd ");
+        expression(3);
+        return;
+    }
+    expression(3);
+    printf(" %s ", operators[pick(6)]);
+    expression(3);
+}
+
+void statement(int n, int nesting);
+
+void statements(int n, int nesting) {
+    int count = 1 + pick(4);
+    indent(n);
+    printf("begin\n");
+    for (int i = 0; i < count; i++) {
+        statement(n + 1, nesting);
+        printf(i + 1 < count ? ";\n" : "\n");
+    }
+    indent(n);
+    printf("end");
+}
+
+void statement(int n, int nesting) {
+    int choice = pick(nesting > 2 ? 4 : 7);
+    if (choice <= 1) {
+        indent(n);
+        variable(0);
+        printf(" := ");
+        expression(4);
+    } else if (choice == 2) {
+        indent(n);
+        printf("write ");
+        expression(4);
+    } else if (choice == 3) {
+        int total = 0;
+        for (int d = 0; d <= depth; d++) {
+            total += scopes[d].procCount;
+        }
+        indent(n);
+        if (total == 0) {
+            printf("write 0");
+            return;
+        }
+        int k = pick(total);
+        for (int d = 0; d <= depth; d++) {
+            if (k < scopes[d].procCount) {
+                printf("call %s", scopes[d].procs[k]);
+                return;
+            }
+            k -= scopes[d].procCount;
+        }
+    } else if (choice == 4) {
+        indent(n);
+        printf("if ");
+        condition();
+        printf(" then\n");
+        statements(n + 1, nesting + 1);
+    } else if (scopes[depth].loops < 4) {
+        // the counter is declared by this scope's block, see block()
+        int counter = scopes[depth].loops++;
+        indent(n);
+        printf("l%d%d := 0;\n", depth, counter);
+        indent(n);
+        printf("while l%d%d < %d do\n", depth, counter, 1 + pick(5));
+        indent(n);
+        printf("begin\n");
+        statement(n + 1, nesting + 1);
+        printf(";\n");
+        if (pick(2)) {
+            statement(n + 1, nesting + 1);
+            printf(";\n");
+        }
+        indent(n + 1);
+        printf("l%d%d := l%d%d + 1\n", depth, counter, depth, counter);
+        indent(n);
+        printf("end");
+        scopes[depth].loops--; // reusable once the loop is over
+    } else {
+        indent(n);
+        printf("write 1");
+    }
+}
+
+// a block at the current depth: declarations, nested procedures, body
+void block(int n, int isMain) {
+    scope *s = &scopes[depth];
+    s->varCount = isMain ? 3 + pick(4) : pick(4);
+    s->procCount = 0;
+    s->loops = 0;
+    if (pick(2)) {
+        printf("const c%d = %d;\n", depth, pick(20));
+    }
+    printf("var l%d0, l%d1, l%d2, l%d3", depth, depth, depth, depth);
+    for (int i = 0; i < s->varCount; i++) {
+        snprintf(s->vars[i], sizeof(s->vars[i]), "v%d", varNumber++);
+        printf(", %s", s->vars[i]);
+    }
+    printf(";\n");
+    int procs = depth < 3 ? pick(4) : 0;
+    for (int i = 0; i < procs; i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "p%d", procNumber++);
+        printf("procedure %s;\n", name);
+        depth++;
+        block(n + 1, 0);
+        depth--;
+        printf(";\n");
+        // callable only after its own body, so never recursively
+        snprintf(s->procs[s->procCount++], sizeof(s->procs[0]), "%s", name);
+    }
+    // a new frame holds whatever an earlier call left on the stack, which
+    // differs once -O changes frame layouts, so every variable is set
+    // before anything reads it
+    indent(n);
+    printf("begin\n");
+    indent(n + 1);
+    printf("l%d0 := 0; l%d1 := 0; l%d2 := 0; l%d3 := 0", depth, depth, depth, depth);
+    for (int i = 0; i < s->varCount; i++) {
+        printf(";\n");
+        indent(n + 1);
+        printf("%s := %d", s->vars[i], pick(10));
+    }
+    printf(";\n");
+    if (isMain) {
+        printf("    read %s; read %s; read %s;\n", s->vars[0], s->vars[1], s->vars[2]);
+        for (int i = 0; i < 4 + pick(6); i++) {
+            statement(1, 0);
+            printf(";\n");
+        }
+        printf("    write %s\n", s->vars[0]);
+    } else {
+        statements(n + 1, 0);
+        printf("\n");
+    }
+    indent(n);
+    printf("end");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: genprog <seed>\n");
+        return 1;
+    }
+    srand(atoi(argv[1]));
+    block(0, 1);
+    printf(".\n");
+    return 0;
+}
@@ -0,0 +1,110 @@
+#!/bin/sh
+# differential test of the optimizer: every tests/*.pl0 is compiled with
+# and without -O, both run on the vm with tests/input.txt as stdin and
+# must print <name>.out. the instruction totals of both builds are the
+# corpus numbers the optimization report is about. the -spmd, -fork,
+# -batch, -cache and -codecache run modes must also print what scalar
+# runs print for every program.
+#
+# usage: tests/run.sh [-fuzz <programs>]
+# -fuzz also compiles that many programs from genprog.c with and without
+# -O and checks the two print the same, keeping any that differ in
+# fuzz-<seed>.pl0 in the current directory
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cc=${CC:-gcc}
+$cc -O2 -o "$work/compiler" "$tests/../compiler.c" || exit 1
+$cc -O2 -o "$work/vm" "$tests/../vm.c" -pthread || exit 1
+$cc -O2 -o "$work/genprog" "$tests/genprog.c" || exit 1
+cd "$work"
+
+# run source $1 compiled with flags $2, leave the vm output in $output
+# (its first 4KB) and the instruction count in $count. a miscompiled loop
+# may not end, so runs are cut off after 10 seconds
+run() {
+    count=0
+    if ! ./compiler $2 "$1" > listing.txt; then
+        output="compile failed"
+        return
+    fi
+    count=$(wc -l < elf.txt)
+    output=$(timeout 10 ./vm -q elf.txt < "$tests/input.txt" 2>&1 | head -c 4096)
+}
+
+failures=0
+plain=0
+optimized=0
+for source in "$tests"/*.pl0; do
+    name=$(basename "$source" .pl0)
+    expected=$(cat "$tests/$name.out")
+    for flags in "" "-O"; do
+        run "$source" "$flags"
+        if [ "$flags" = "" ]; then
+            plain=$((plain + count))
+        else
+            optimized=$((optimized + count))
+        fi
+        if [ "$output" != "$expected" ]; then
+            echo "FAIL $name $flags: got '$output', expected '$expected'"
+            failures=$((failures + 1))
+        fi
+    done
+done
+echo "corpus: $(ls "$tests"/*.pl0 | wc -l) programs, $plain instructions, $optimized with -O"
+
+# every other run mode must print what scalar runs print for every
+# program. vm -spmd runs 16 inputs side by side, 20 rows take two groups,
+# and 0 makes the programs that divide by an input fault. -fork and -batch
+# run each row in a forked child or a pooled instance. the second pass of
+# -codecache maps the image the first stored, and the second pass of
+# -cache must replay byte for byte what the first run of a row printed
+check() {
+    if ! cmp -s "$2" scalar.txt; then
+        echo "FAIL $name $1: $(diff "$2" scalar.txt | head -3 | tr '\n' ' ')"
+        failures=$((failures + 1))
+    fi
+}
+seq 0 19 > rows.txt
+for source in "$tests"/*.pl0; do
+    name=$(basename "$source" .pl0)
+    ./compiler "$source" > listing.txt
+    rm -rf cache images
+    while read -r row; do
+        echo "$row" | ./vm -q elf.txt
+    done < rows.txt > scalar.txt
+    ./vm -spmd elf.txt < rows.txt > spmd.txt
+    check -spmd spmd.txt
+    ./vm -fork elf.txt < rows.txt > fork.txt
+    check -fork fork.txt
+    ./vm -batch 4 elf.txt < rows.txt > batch.txt
+    check -batch batch.txt
+    for pass in miss hit; do
+        while read -r row; do
+            echo "$row" | ./vm -cache cache elf.txt
+        done < rows.txt > cache.txt
+        check "-cache $pass" cache.txt
+        while read -r row; do
+            echo "$row" | ./vm -q -codecache images elf.txt
+        done < rows.txt > codecache.txt
+        check "-codecache $pass" codecache.txt
+    done
+done
+
+if [ "$1" = "-fuzz" ]; then
+    for seed in $(seq 1 "$2"); do
+        ./genprog "$seed" > fuzz.pl0
+        run fuzz.pl0 ""
+        plainOutput=$output
+        run fuzz.pl0 "-O"
+        if [ "$output" != "$plainOutput" ] || [ "$plainOutput" = "compile failed" ]; then
+            echo "FAIL fuzz seed $seed: -O printed '$(echo "$output" | cut -c1-100)', plain '$(echo "$plainOutput" | cut -c1-100)'"
+            cp fuzz.pl0 "$OLDPWD/fuzz-$seed.pl0"
+            failures=$((failures + 1))
+        fi
+    done
+    echo "fuzz: $2 programs"
+fi
+
+echo "failures: $failures"
+[ "$failures" -eq 0 ]
@@ -1,11 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-// prototypes
-int base(int BP, int L);
-void initializePas();
-int loadInstructions(const char* filename);
+// default stack words per instance (-stack)
+#define STACK_SIZE 512
+// touched stack bytes past which release hands pages back instead of zeroing
+#define MADVISE_THRESHOLD (64 * 1024)
+// instances run side by side in -spmd mode
+#define LANES 16
+// default bound on the bytes kept in a -cache directory
+#define CACHE_LIMIT (64LL * 1024 * 1024)
 
 typedef struct {
     int OP;
@@ -13,69 +28,470 @@ typedef struct {
     int M;
 } Instruction;
 
-int pas[512];
-Instruction ir;
-int bp = 0;
-int sp = 0;
-int pc = 0;
-int halt = 1;
+// a verified program. images are immutable once built, shared by every vm
+// running the same code and either heap allocated or mapped read-only from
+// a code cache file
+typedef struct CodeImage {
+    unsigned long long hash; // of the program text, the cache key
+    int words; // code size in pas words, stack addresses start here
+    int count; // instructions, code[pc / 3]
+    const Instruction *code;
+    atomic_int refs;
+    void *map; // whole cache file when mapped, else NULL
+    size_t mapLen;
+    struct CodeImage *next;
+} CodeImage;
+
+// header of a code cache file, the instructions follow it
+typedef struct {
+    char magic[4];
+    int words;
+    unsigned long long hash;
+} ImageHeader;
+
+// one instance: registers and a private stack. pas is addressed like the
+// original single array, code words first, but only the stack part
+// [base, limit) is ever touched
+typedef struct {
+    CodeImage *image;
+    int *pas;
+    size_t pasLen; // bytes mapped for pas
+    int base;
+    int limit;
+    int touched; // highest stack address written since the last clear
+    int bp;
+    int sp;
+    int pc;
+    int halt;
+    // SYS 1 values written this run, used to space quiet output
+    int outputCount;
+    // run statistics
+    long long executed;
+    int peakSp;
+    // where SYS 2 reads from and quiet SYS 1 writes to
+    FILE *input;
+    FILE *output;
+    int slot; // index in its pool
+} VM;
+
+// reusable instances of one image. free slots form a lock-free stack whose
+// head packs a generation tag above the slot number so a pop can't be
+// fooled by a slot that was popped and pushed back in between (ABA)
+typedef struct {
+    CodeImage *image;
+    VM **slots;
+    int *next;
+    int capacity;
+    atomic_int created;
+    _Atomic unsigned long long head; // tag << 32 | slot + 1, 0 when empty
+} VMPool;
+
+// prototypes
+int base(int *pas, int limit, int BP, int L);
+int defaultStack(const CodeImage *image);
+void initializePas(VM *vm);
+VMPool *createPool(CodeImage *image, int capacity);
+VM *acquireVM(VMPool *pool);
+void releaseVM(VMPool *pool, VM *vm);
+void destroyPool(VMPool *pool);
+int batchRun(CodeImage *image, int threads, int timing);
+int *loadInstructions(const char* filename, int *IC, unsigned long long *hash);
+int verifyProgram(const int *words, int IC);
+CodeImage *acquireImage(const char *filename);
+void releaseImage(CodeImage *image);
+VM *createVM(CodeImage *image);
+void destroyVM(VM *vm);
+void resetRegisters(VM *vm, FILE *in, FILE *out);
+int fault(VM *vm, const char *why);
+void execute(VM *vm);
+double now();
+int serveRequest(VM *vm, const char* line, int cold, char* self, char* filename, int quietOutput);
+int forkServer(VM *vm, char* self, char* filename, int timing);
+int spmdBatch(CodeImage *image, int timing);
+unsigned long long hashInts(unsigned long long h, const int *values, int count);
+int cachedRun(VM *vm, const char *dir, long long limit, int showStats);
+
+// print the execution trace (off with -q)
+int trace = 1;
+// images loaded in this process, at most one per distinct program
+CodeImage *images = NULL;
+// directory of mapped images shared between processes (-codecache)
+char *codeCacheDir = NULL;
+// stack words per instance
+int stackSize = STACK_SIZE;
+
+// default stack for an image: its largest frame on top of STACK_SIZE words
+// for calls and expressions, so big generated programs run without -stack
+int defaultStack(const CodeImage *image) {
+    int largest = 0;
+    for (int i = 0; i < image->words / 3; i++) {
+        if (image->code[i].OP == 6 && image->code[i].M > largest) {
+            largest = image->code[i].M;
+        }
+    }
+    return STACK_SIZE + largest;
+}
 
-int base(int BP, int L) {
+int base(int *pas, int limit, int BP, int L) {
     int arb = BP; //arb = activation record base
     while (L > 0) {
+        if (arb < 0 || arb >= limit) {
+            return -1; // static link was overwritten
+        }
         arb = pas[arb];
         L--;
     }
     return arb;
 }
 
-void initializePas() {
-    for (int i = 0; i < 512; i++) {
-        pas[i] = 0;
+// zero the stack for the next run. pas starts out as fresh zero pages, so
+// only what earlier runs wrote up to the high-water mark needs clearing,
+// and big ranges are handed back to the kernel instead of being written
+void initializePas(VM *vm) {
+    if (vm->touched < vm->base) {
+        return;
+    }
+    char *from = (char*)&vm->pas[vm->base];
+    char *to = (char*)&vm->pas[vm->touched + 1];
+    if (to - from >= MADVISE_THRESHOLD) {
+        long page = sysconf(_SC_PAGESIZE);
+        char *first = (char*)(((unsigned long)from + page - 1) & ~(page - 1));
+        char *last = (char*)((unsigned long)to & ~(page - 1));
+        memset(from, 0, first - from);
+        if (madvise(first, last - first, MADV_DONTNEED) != 0) {
+            memset(first, 0, last - first);
+        }
+        memset(last, 0, to - last);
+    } else {
+        memset(from, 0, to - from);
     }
+    vm->touched = vm->base - 1;
 }
 
-int loadInstructions(const char* filename) {
+// read the text form of a program into a flat word array and hash the text
+int *loadInstructions(const char* filename, int *IC, unsigned long long *hash) {
     FILE *file = fopen(filename, "r");
-    int IC = 0;
+    if (file == NULL) {
+        printf("Error: File not found\n");
+        return NULL;
+    }
+    int size = 3 * 64;
+    int *words = malloc(size * sizeof(int));
     int OP, L, M;
-    while (fscanf(file, "%d %d %d", &OP, &L, &M) != EOF) {
-        pas[IC] = OP;
-        pas[IC+1] = L;
-        pas[IC+2] = M;
-        IC+=3;
+    *IC = 0;
+    while (fscanf(file, "%d %d %d", &OP, &L, &M) == 3) {
+        if (*IC + 3 > size) {
+            size *= 2;
+            words = realloc(words, size * sizeof(int));
+        }
+        words[*IC] = OP;
+        words[*IC+1] = L;
+        words[*IC+2] = M;
+        *IC+=3;
+    }
+    // hash the raw text so a shared or cached image can be looked up by it
+    rewind(file);
+    unsigned long long h = 14695981039346656037ULL;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
     }
+    *hash = h;
     fclose(file);
-    return IC;
+    return words;
 }
 
-int main (int argc, char *argv[]) {
-    initializePas();
+// check every instruction once so the program can be run many times unchecked
+int verifyProgram(const int *words, int IC) {
+    if (IC == 0) {
+        printf("Error: empty program\n");
+        return 0;
+    }
+    for (int i = 0; i < IC; i += 3) {
+        int OP = words[i], L = words[i+1], M = words[i+2];
+        int ok = L >= 0;
+        switch (OP) {
+            case 1: case 6: // LIT, INC
+                break;
+            case 2: // OPR
+                ok = ok && M >= 0 && M <= 11;
+                break;
+            case 3: case 4: // LOD, STO
+                ok = ok && M >= 0;
+                break;
+            case 5: case 7: case 8: // CAL, JMP, JPC
+                ok = ok && M >= 0 && M < IC && M % 3 == 0;
+                break;
+            case 9: // SYS
+                ok = ok && M >= 1 && M <= 3;
+                break;
+            default:
+                ok = 0;
+        }
+        if (!ok) {
+            printf("Error: invalid instruction %d %d %d at %d\n", OP, L, M, i);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    int numInstructions = loadInstructions(argv[1]);
+// map the cached image for hash if there is one and it holds this code
+CodeImage *mapImage(const char *path, unsigned long long hash, const int *words, int IC) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    size_t len = sizeof(ImageHeader) + (IC / 3) * sizeof(Instruction);
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != len) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const ImageHeader *header = map;
+    const Instruction *code = (const Instruction*)(header + 1);
+    if (memcmp(header->magic, "PL0I", 4) != 0 || header->hash != hash || header->words != IC
+            || memcmp(code, words, IC * sizeof(int)) != 0) {
+        munmap(map, len);
+        return NULL;
+    }
+    CodeImage *image = calloc(1, sizeof(CodeImage));
+    image->map = map;
+    image->mapLen = len;
+    image->code = code;
+    return image;
+}
+
+// write a verified image to the code cache, atomically so that other
+// processes only ever map complete files
+void storeImage(const char *path, unsigned long long hash, const Instruction *code, int IC) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        return;
+    }
+    ImageHeader header = {{'P', 'L', '0', 'I'}, IC, hash};
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(code, sizeof(Instruction), IC / 3, file);
+    if (fclose(file) == 0) {
+        rename(tmp, path);
+    } else {
+        unlink(tmp);
+    }
+}
+
+// get the shared image of a program. in this process images are looked up
+// by content hash and reference counted, across processes they come from a
+// read-only mapping of the code cache file when -codecache is set
+CodeImage *acquireImage(const char *filename) {
+    int IC;
+    unsigned long long hash;
+    int *words = loadInstructions(filename, &IC, &hash);
+    if (words == NULL) {
+        return NULL;
+    }
+    for (CodeImage *image = images; image != NULL; image = image->next) {
+        if (image->hash == hash && image->words == IC && memcmp(image->code, words, IC * sizeof(int)) == 0) {
+            atomic_fetch_add(&image->refs, 1);
+            free(words);
+            return image;
+        }
+    }
+
+    // a cached image is only a way to share code pages, whoever wrote it,
+    // so the program is verified either way
+    if (!verifyProgram(words, IC)) {
+        free(words);
+        return NULL;
+    }
+    CodeImage *image = NULL;
+    char path[4096];
+    if (codeCacheDir != NULL) {
+        snprintf(path, sizeof(path), "%s/%016llx.img", codeCacheDir, hash);
+        image = mapImage(path, hash, words, IC);
+    }
+    if (image == NULL) {
+        Instruction *code = malloc((IC / 3 + 1) * sizeof(Instruction));
+        for (int i = 0; i < IC; i += 3) {
+            code[i / 3].OP = words[i];
+            code[i / 3].L = words[i + 1];
+            code[i / 3].M = words[i + 2];
+        }
+        if (codeCacheDir != NULL) {
+            mkdir(codeCacheDir, 0755);
+            storeImage(path, hash, code, IC);
+            image = mapImage(path, hash, words, IC);
+        }
+        if (image == NULL) {
+            image = calloc(1, sizeof(CodeImage));
+            image->code = code;
+        } else {
+            free(code);
+        }
+    }
+    free(words);
+    image->hash = hash;
+    image->words = IC;
+    image->count = IC / 3;
+    image->refs = 1;
+    image->next = images;
+    images = image;
+    return image;
+}
 
-    bp = numInstructions;
-    sp = bp - 1;
-    pc = 0;
+void releaseImage(CodeImage *image) {
+    if (atomic_fetch_sub(&image->refs, 1) > 1) {
+        return;
+    }
+    for (CodeImage **p = &images; *p != NULL; p = &(*p)->next) {
+        if (*p == image) {
+            *p = image->next;
+            break;
+        }
+    }
+    if (image->map != NULL) {
+        munmap(image->map, image->mapLen);
+    } else {
+        free((void*)image->code);
+    }
+    free(image);
+}
 
-    printf("\t\t\tPC\tBP\tSP\tstack\n");
-    printf("Initial values:\t\t%d\t%d\t%d\n\n", pc, bp, sp);
+VM *createVM(CodeImage *image) {
+    VM *vm = calloc(1, sizeof(VM));
+    atomic_fetch_add(&image->refs, 1);
+    vm->image = image;
+    vm->base = image->words;
+    vm->limit = image->words + stackSize;
+    vm->touched = vm->base - 1;
+    vm->slot = -1;
+    // anonymous pages read as zero and cost nothing until written, so the
+    // code words in front of the stack and the unused top are free
+    vm->pasLen = (size_t)vm->limit * sizeof(int);
+    vm->pas = mmap(NULL, vm->pasLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm->pas == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return vm;
+}
 
+void destroyVM(VM *vm) {
+    releaseImage(vm->image);
+    munmap(vm->pas, vm->pasLen);
+    free(vm);
+}
+
+VMPool *createPool(CodeImage *image, int capacity) {
+    VMPool *pool = calloc(1, sizeof(VMPool));
+    pool->image = image;
+    pool->capacity = capacity;
+    pool->slots = calloc(capacity, sizeof(VM*));
+    pool->next = calloc(capacity, sizeof(int));
+    atomic_init(&pool->created, 0);
+    atomic_init(&pool->head, 0);
+    return pool;
+}
+
+// pop a free instance, or create one while the pool has room. returns an
+// unpooled instance once every slot is in use
+VM *acquireVM(VMPool *pool) {
+    unsigned long long head = atomic_load(&pool->head);
+    while ((head & 0xffffffffULL) != 0) {
+        int slot = (int)(head & 0xffffffffULL) - 1;
+        unsigned long long next = ((head >> 32) + 1) << 32 | (unsigned)(pool->next[slot] + 1);
+        if (atomic_compare_exchange_weak(&pool->head, &head, next)) {
+            return pool->slots[slot];
+        }
+    }
+    VM *vm = createVM(pool->image);
+    int slot = atomic_fetch_add(&pool->created, 1);
+    if (slot < pool->capacity) {
+        vm->slot = slot;
+        pool->slots[slot] = vm;
+    }
+    return vm;
+}
+
+// clear what the run touched and push the instance back on the free stack
+void releaseVM(VMPool *pool, VM *vm) {
+    if (vm->slot < 0) {
+        destroyVM(vm);
+        return;
+    }
+    initializePas(vm);
+    unsigned long long head = atomic_load(&pool->head);
+    unsigned long long next;
+    do {
+        pool->next[vm->slot] = (int)(head & 0xffffffffULL) - 1;
+        next = ((head >> 32) + 1) << 32 | (unsigned)(vm->slot + 1);
+    } while (!atomic_compare_exchange_weak(&pool->head, &head, next));
+}
+
+// only once no thread uses the pool any more
+void destroyPool(VMPool *pool) {
+    int created = atomic_load(&pool->created);
+    for (int i = 0; i < created && i < pool->capacity; i++) {
+        destroyVM(pool->slots[i]);
+    }
+    free(pool->slots);
+    free(pool->next);
+    free(pool);
+}
+
+// set up the initial activation record just past the code
+void resetRegisters(VM *vm, FILE *in, FILE *out) {
+    vm->bp = vm->base;
+    vm->sp = vm->bp - 1;
+    vm->pc = 0;
+    vm->halt = 1;
+    vm->outputCount = 0;
+    vm->executed = 0;
+    vm->peakSp = vm->sp;
+    vm->input = in;
+    vm->output = out;
+}
+
+// report a runtime error, returns the halt flag value that stops the run
+int fault(VM *vm, const char *why) {
+    if (trace) {
+        printf("Error: %s\n", why);
+    } else {
+        fprintf(vm->output, vm->outputCount > 0 ? " Error: %s" : "Error: %s", why);
+    }
+    return 0;
+}
+
+// fetch/execute cycle, runs until SYS 3
+void execute(VM *vm) {
+    int *pas = vm->pas;
+    const Instruction *code = vm->image->code;
+    int bp = vm->bp, sp = vm->sp, pc = vm->pc, halt = vm->halt;
+    int limit = vm->limit - 4; // room for the next CAL's links at sp+1..sp+3
+    long long executed = vm->executed;
+    int peakSp = vm->peakSp;
+    int touched = vm->touched;
+    Instruction ir;
+    int arb;
     while (halt != 0) {
         // fetch
-        ir.OP = pas[pc];
-        ir.L = pas[pc + 1];
-        ir.M = pas[pc + 2];
+        ir = code[pc / 3];
         pc = pc + 3;
 
         // execute
-        int arb = base(bp, ir.L);
         switch(ir.OP) {
             case 1: // LIT
                 sp++;
                 pas[sp] = ir.M;
                 //text output
-                printf("\tLIT %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tLIT %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 2: // OPR
@@ -85,105 +501,130 @@ int main (int argc, char *argv[]) {
                         bp = pas[sp + 2];
                         pc = pas[sp + 3];
                         // text output
-                        printf("\tRTN %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tRTN %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 1: // ADD
                         pas[sp - 1] = pas[sp - 1] + pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tADD %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tADD %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 2: // SUB
                         pas[sp - 1] = pas[sp - 1] - pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tSUB %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tSUB %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 3: // MUL
                         pas[sp - 1] = pas[sp - 1] * pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tMUL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tMUL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 4: // DIV
+                        if (pas[sp] == 0 || (pas[sp] == -1 && pas[sp - 1] == -2147483647 - 1)) {
+                            halt = fault(vm, "division by zero");
+                            break;
+                        }
                         pas[sp - 1] = pas[sp - 1] / pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tDIV %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tDIV %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 5: // EQL
                         pas[sp - 1] = pas[sp - 1] == pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tEQL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tEQL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 6: // NEQ
                         pas[sp - 1] = pas[sp - 1] != pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tNEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tNEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 7: // LSS
                         pas[sp - 1] = pas[sp - 1] < pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tLSS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tLSS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 8: // LEQ
                         pas[sp - 1] = pas[sp - 1] <= pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tLEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tLEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 9: // GTR
                         pas[sp - 1] = pas[sp - 1] > pas[sp];
                         sp = sp - 1;
                         // text output
-                        printf("\tGTR %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tGTR %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                     case 10: // GEQ
                         pas[sp - 1] = pas[sp - 1] >= pas[sp];
                         sp = sp - 1;
                         // text output 
-                        printf("\tGEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tGEQ %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        break;
+                    case 11: // ODD
+                        pas[sp] = pas[sp] % 2 != 0;
+                        // text output
+                        if (trace) printf("\tODD %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                 }
                 break;
             
             case 3: // LOD
+                arb = base(pas, vm->limit, bp, ir.L) + ir.M;
+                if (arb < vm->base || arb >= vm->limit) {
+                    halt = fault(vm, "address out of range");
+                    break;
+                }
                 sp = sp + 1;
-                pas[sp] = pas[base(bp, ir.L) + ir.M];
+                pas[sp] = pas[arb];
                 // text output
-                printf("\tLOD %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tLOD %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 4: // STO
-                pas[base(bp, ir.L) + ir.M] = pas[sp];
+                arb = base(pas, vm->limit, bp, ir.L) + ir.M;
+                if (arb < vm->base || arb >= vm->limit) {
+                    halt = fault(vm, "address out of range");
+                    break;
+                }
+                pas[arb] = pas[sp];
+                if (arb > touched) {
+                    touched = arb;
+                }
                 sp = sp - 1;
                 // text output
-                printf("\tSTO %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tSTO %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 5: // CAL
-                pas[sp + 1] = base(bp, ir.L);
+                if (sp + 3 > touched) {
+                    touched = sp + 3;
+                }
+                pas[sp + 1] = base(pas, vm->limit, bp, ir.L);
                 pas[sp + 2] = bp;
                 pas[sp + 3] = pc;
                 bp = sp + 1;
                 pc = ir.M;
                 // text output
-                printf("\tCAL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tCAL %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 6: // INC
                 sp = sp + ir.M;
                 // text output
-                printf("\tINC %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tINC %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 7: // JMP
                 pc = ir.M;
                 // text output
-                printf("\tJMP %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tJMP %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 8: // JPC
@@ -192,47 +633,60 @@ int main (int argc, char *argv[]) {
                 }
                 sp = sp - 1;
                 // text output
-                printf("\tJPC %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                if (trace) printf("\tJPC %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                 break;
 
             case 9: // SYS
                 switch(ir.M) {
                     case 1: // write
-                        printf("Output result is: %d\n", pas[sp]);
+                        if (trace) {
+                            printf("Output result is: %d\n", pas[sp]);
+                        } else {
+                            fprintf(vm->output, vm->outputCount > 0 ? " %d" : "%d", pas[sp]);
+                        }
+                        vm->outputCount++;
                         sp = sp - 1;
                         // text output
-                        printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
 
                     case 2: // read
                         sp = sp + 1;
-                        printf("Please Enter an Integer: ");
-                        scanf("%d", &pas[sp]);
+                        if (trace) printf("Please Enter an Integer: ");
+                        if (fscanf(vm->input, "%d", &pas[sp]) != 1) {
+                            pas[sp] = 0;
+                        }
                         // text output
-                        printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
 
                     case 3: // halt
                         halt = 0;
                         // text output
-                        printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
+                        if (trace) printf("\tSYS %d\t%d\t%d\t%d\t%d\t", ir.L, ir.M, pc, bp, sp);
                         break;
                 }
                 break;
         }
-        // print stack
-        char currentAR[256] = "";
-        char tmp[16];
-        // store current AR
-        for (int j = bp; j <= sp; j++) {
-            sprintf(tmp, "%d ", pas[j]);
-            strcat(currentAR, tmp);
+        executed++;
+        if (sp > peakSp) {
+            peakSp = sp;
         }
-
+        // sp leaves the stack on either side through INC, and RTN takes pc
+        // from the stack, which a STO may have overwritten
+        if (sp > limit || sp < vm->base - 1) {
+            halt = fault(vm, "stack overflow");
+        } else if (halt != 0 && (pc < 0 || pc >= vm->base || pc % 3 != 0)) {
+            halt = fault(vm, "return address out of range");
+        }
+        if (!trace) {
+            continue;
+        }
+        // print stack, within the instance's words even after a fault
         int arPointer = pas[bp + 1]; 
         int previousSP = bp - 1;  
         // print ARs
-        while (arPointer > 0) {
+        while (arPointer >= vm->base && arPointer <= previousSP) {
             for (int j = arPointer; j <= previousSP; j++) {
                 printf("%d ", pas[j]);
             }
@@ -242,9 +696,921 @@ int main (int argc, char *argv[]) {
             previousSP = arPointer - 1;  
             arPointer = pas[arPointer + 1];  
         }
-        // print current AR
-        printf("%s\n", currentAR);
+        // print current AR, straight from the stack since a large frame
+        // does not fit any fixed buffer
+        for (int j = bp; j <= sp && j < vm->limit; j++) {
+            printf("%d ", pas[j]);
+        }
+        printf("\n");
+    }
+    vm->bp = bp;
+    vm->sp = sp;
+    vm->pc = pc;
+    vm->halt = halt;
+    vm->executed = executed;
+    vm->peakSp = peakSp;
+    vm->touched = touched > peakSp ? touched : peakSp;
+    if (!trace) {
+        fprintf(vm->output, "\n");
+    }
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// run one request in a child process fed through a pipe. a warm child is a
+// copy-on-write fork of the already loaded and verified program, a cold one
+// execs a fresh vm that has to load it again
+int serveRequest(VM *vm, const char* line, int cold, char* self, char* filename, int quietOutput) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fd[1]);
+        if (quietOutput) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, 1);
+            close(devNull);
+        }
+        if (cold) {
+            dup2(fd[0], 0);
+            close(fd[0]);
+            execlp(self, self, "-q", filename, (char*)NULL);
+            _exit(127);
+        }
+        resetRegisters(vm, fdopen(fd[0], "r"), stdout);
+        execute(vm);
+        fflush(stdout);
+        _exit(0);
+    }
+    close(fd[0]);
+    size_t len = strlen(line);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd[1], line + written, len - written);
+        if (n <= 0) {
+            break; // child stopped reading
+        }
+        written += n;
+    }
+    close(fd[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// each line on stdin is the input of one run, each run prints one line.
+// with timing on, the requests are replayed through warm forks and cold
+// execs with output discarded and the per run cost is reported
+int forkServer(VM *vm, char* self, char* filename, int timing) {
+    signal(SIGPIPE, SIG_IGN);
+
+    char *line = NULL;
+    size_t cap = 0;
+    if (!timing) {
+        while (getline(&line, &cap, stdin) != -1) {
+            if (serveRequest(vm, line, 0, self, filename, 0) != 0) {
+                fprintf(stderr, "Error: request failed\n");
+            }
+        }
+        free(line);
+        return 0;
+    }
+
+    int count = 0, size = 64;
+    char **requests = malloc(size * sizeof(char*));
+    while (getline(&line, &cap, stdin) != -1) {
+        if (count == size) {
+            size *= 2;
+            requests = realloc(requests, size * sizeof(char*));
+        }
+        requests[count++] = strdup(line);
+    }
+    free(line);
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        serveRequest(vm, requests[i], 0, self, filename, 1);
+    }
+    double warm = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        serveRequest(vm, requests[i], 1, self, filename, 1);
+    }
+    double cold = now() - start;
+
+    if (count > 0) {
+        fprintf(stderr, "fork-server: %d runs in %.3f ms (%.1f us/run)\n", count, warm * 1e3, warm * 1e6 / count);
+        fprintf(stderr, "cold exec:   %d runs in %.3f ms (%.1f us/run)\n", count, cold * 1e3, cold * 1e6 / count);
+        fprintf(stderr, "speedup:     %.2fx\n", warm > 0 ? cold / warm : 0.0);
+    }
+    for (int i = 0; i < count; i++) {
+        free(requests[i]);
+    }
+    free(requests);
+    return 0;
+}
+
+// one input vector of a batch and everything its run produced
+typedef struct {
+    char *text;
+    int *in;
+    int inCount;
+    int inPos;
+    int *out;
+    int outCount;
+    int outSize;
+    const char *fault;
+} Row;
+
+// lanes sharing pc, bp and sp. control flow only depends on data at JPC,
+// so lanes stay in lockstep until a JPC splits them into two groups
+typedef struct {
+    int pc;
+    int bp;
+    int sp;
+    int mask[LANES];
+} LaneGroup;
+
+Row readRow(char *line) {
+    Row row = {0};
+    row.text = strdup(line);
+    int size = 8;
+    row.in = malloc(size * sizeof(int));
+    char *p = line, *end;
+    for (long v = strtol(p, &end, 10); end != p; v = strtol(p, &end, 10)) {
+        if (row.inCount == size) {
+            size *= 2;
+            row.in = realloc(row.in, size * sizeof(int));
+        }
+        row.in[row.inCount++] = (int)v;
+        p = end;
+    }
+    return row;
+}
+
+// one row per line of stdin
+Row *readRows(int *count) {
+    int size = 64;
+    Row *rows = malloc(size * sizeof(Row));
+    char *line = NULL;
+    size_t cap = 0;
+    *count = 0;
+    while (getline(&line, &cap, stdin) != -1) {
+        if (*count == size) {
+            size *= 2;
+            rows = realloc(rows, size * sizeof(Row));
+        }
+        rows[(*count)++] = readRow(line);
+    }
+    free(line);
+    return rows;
+}
+
+void laneOutput(Row *row, int value) {
+    if (row->outCount == row->outSize) {
+        row->outSize = row->outSize ? row->outSize * 2 : 8;
+        row->out = realloc(row->out, row->outSize * sizeof(int));
+    }
+    row->out[row->outCount++] = value;
+}
+
+// drop lanes that hit a runtime error from the group, returns lanes left
+int laneFault(LaneGroup *g, Row *rows, const int *bad, const char *why) {
+    int active = 0;
+    for (int l = 0; l < LANES; l++) {
+        if (g->mask[l] && bad[l]) {
+            g->mask[l] = 0;
+            rows[l].fault = why;
+        }
+        active += g->mask[l];
+    }
+    return active;
+}
+
+// lane version of base(), static links are the same in every active lane
+int laneBase(int (*mem)[LANES], int lead, int limit, int BP, int L) {
+    int arb = BP;
+    while (L > 0) {
+        if (arb < 0 || arb >= limit) {
+            return -1;
+        }
+        arb = mem[arb][lead];
+        L--;
     }
+    return arb;
+}
 
+// run up to LANES rows of the program together, one lane per row. mem is
+// lane-parallel memory: cell a of lane l is mem[a][l], so each cell is one
+// contiguous vector across the lanes
+void runLanes(CodeImage *image, int (*mem)[LANES], Row *rows, int count) {
+    int IC = image->words;
+    int limit = IC + stackSize;
+    LaneGroup groups[LANES];
+    int groupCount = 1;
+    groups[0].pc = 0;
+    groups[0].bp = IC;
+    groups[0].sp = IC - 1;
+    for (int l = 0; l < LANES; l++) {
+        groups[0].mask[l] = l < count;
+    }
+
+    while (groupCount > 0) {
+        LaneGroup g = groups[--groupCount];
+        int *m = g.mask;
+        int bad[LANES];
+        int lead = 0; // any active lane, frame links are the same in all of them
+        while (!m[lead]) {
+            lead++;
+        }
+        int running = 1;
+        while (running) {
+            const char *why = NULL;
+            if (g.sp + 4 > limit || g.sp < IC - 1) {
+                why = "stack overflow";
+            } else if (g.pc < 0 || g.pc >= IC || g.pc % 3 != 0) {
+                why = "return address out of range";
+            }
+            if (why != NULL) {
+                for (int l = 0; l < LANES; l++) {
+                    bad[l] = 1;
+                }
+                laneFault(&g, rows, bad, why);
+                break;
+            }
+            Instruction in = image->code[g.pc / 3];
+            int OP = in.OP, L = in.L, M = in.M;
+            int sp = g.sp;
+            g.pc += 3;
+            switch (OP) {
+                case 1: // LIT
+                    sp++;
+                    for (int l = 0; l < LANES; l++) {
+                        mem[sp][l] = m[l] ? M : mem[sp][l];
+                    }
+                    break;
+
+                case 2: // OPR
+                    switch (M) {
+                        case 0: // RTN
+                            sp = g.bp - 1;
+                            g.bp = mem[sp + 2][lead];
+                            g.pc = mem[sp + 3][lead];
+                            break;
+                        case 1: // ADD
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] + mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 2: // SUB
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] - mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 3: // MUL
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] * mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 4: // DIV
+                            for (int l = 0; l < LANES; l++) {
+                                bad[l] = mem[sp][l] == 0 || (mem[sp][l] == -1 && mem[sp - 1][l] == -2147483647 - 1);
+                            }
+                            if (laneFault(&g, rows, bad, "division by zero") == 0) {
+                                running = 0;
+                                break;
+                            }
+                            for (int l = 0; l < LANES; l++) {
+                                int d = m[l] ? mem[sp][l] : 1;
+                                int r = mem[sp - 1][l] / d;
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 5: // EQL
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] == mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 6: // NEQ
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] != mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 7: // LSS
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] < mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 8: // LEQ
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] <= mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 9: // GTR
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] > mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 10: // GEQ
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp - 1][l] >= mem[sp][l];
+                                mem[sp - 1][l] = m[l] ? r : mem[sp - 1][l];
+                            }
+                            sp--;
+                            break;
+                        case 11: // ODD
+                            for (int l = 0; l < LANES; l++) {
+                                int r = mem[sp][l] % 2 != 0;
+                                mem[sp][l] = m[l] ? r : mem[sp][l];
+                            }
+                            break;
+                    }
+                    break;
+
+                case 3: { // LOD
+                    int arb = laneBase(mem, lead, limit, g.bp, L) + M;
+                    if (arb < IC || arb >= limit) {
+                        for (int l = 0; l < LANES; l++) {
+                            bad[l] = 1;
+                        }
+                        laneFault(&g, rows, bad, "address out of range");
+                        running = 0;
+                        break;
+                    }
+                    sp++;
+                    for (int l = 0; l < LANES; l++) {
+                        mem[sp][l] = m[l] ? mem[arb][l] : mem[sp][l];
+                    }
+                    break;
+                }
+
+                case 4: { // STO
+                    int arb = laneBase(mem, lead, limit, g.bp, L) + M;
+                    if (arb < IC || arb >= limit) {
+                        for (int l = 0; l < LANES; l++) {
+                            bad[l] = 1;
+                        }
+                        laneFault(&g, rows, bad, "address out of range");
+                        running = 0;
+                        break;
+                    }
+                    for (int l = 0; l < LANES; l++) {
+                        mem[arb][l] = m[l] ? mem[sp][l] : mem[arb][l];
+                    }
+                    sp--;
+                    break;
+                }
+
+                case 5: { // CAL
+                    int arb = laneBase(mem, lead, limit, g.bp, L);
+                    for (int l = 0; l < LANES; l++) {
+                        mem[sp + 1][l] = m[l] ? arb : mem[sp + 1][l];
+                        mem[sp + 2][l] = m[l] ? g.bp : mem[sp + 2][l];
+                        mem[sp + 3][l] = m[l] ? g.pc : mem[sp + 3][l];
+                    }
+                    g.bp = sp + 1;
+                    g.pc = M;
+                    break;
+                }
+
+                case 6: // INC
+                    sp += M;
+                    break;
+
+                case 7: // JMP
+                    g.pc = M;
+                    break;
+
+                case 8: { // JPC
+                    int taken = 0, active = 0;
+                    for (int l = 0; l < LANES; l++) {
+                        bad[l] = m[l] && mem[sp][l] == 0;
+                        taken += bad[l];
+                        active += m[l];
+                    }
+                    sp--;
+                    if (taken == active) {
+                        g.pc = M;
+                    } else if (taken > 0) {
+                        // split the taken lanes off into a group of their own
+                        LaneGroup *split = &groups[groupCount++];
+                        split->pc = M;
+                        split->bp = g.bp;
+                        split->sp = sp;
+                        for (int l = 0; l < LANES; l++) {
+                            split->mask[l] = bad[l];
+                            m[l] = m[l] && !bad[l];
+                        }
+                        while (!m[lead]) {
+                            lead++;
+                        }
+                    }
+                    break;
+                }
+
+                case 9: // SYS
+                    switch (M) {
+                        case 1: // write
+                            for (int l = 0; l < LANES; l++) {
+                                if (m[l]) {
+                                    laneOutput(&rows[l], mem[sp][l]);
+                                }
+                            }
+                            sp--;
+                            break;
+                        case 2: // read
+                            sp++;
+                            for (int l = 0; l < LANES; l++) {
+                                if (m[l]) {
+                                    mem[sp][l] = rows[l].inPos < rows[l].inCount ? rows[l].in[rows[l].inPos++] : 0;
+                                }
+                            }
+                            break;
+                        case 3: // halt
+                            running = 0;
+                            break;
+                    }
+                    break;
+            }
+            g.sp = sp;
+            if (running && !m[lead]) {
+                lead = 0;
+                while (lead < LANES && !m[lead]) {
+                    lead++;
+                }
+                running = lead < LANES;
+            }
+        }
+    }
+}
+
+// a row's output as a scalar run prints it: what it wrote before a fault
+// comes first
+void printRow(FILE *output, Row *row) {
+    for (int i = 0; i < row->outCount; i++) {
+        fprintf(output, i > 0 ? " %d" : "%d", row->out[i]);
+    }
+    if (row->fault != NULL) {
+        fprintf(output, row->outCount > 0 ? " Error: %s" : "Error: %s", row->fault);
+    }
+    fprintf(output, "\n");
+}
+
+// run every line of stdin as the input vector of one instance of the
+// program, LANES instances at a time. with timing on, the batch is also
+// run one row at a time through the scalar interpreter for comparison
+int spmdBatch(CodeImage *image, int timing) {
+    int count;
+    Row *rows = readRows(&count);
+
+    int (*mem)[LANES] = calloc(image->words + stackSize, sizeof(*mem));
+    double start = now();
+    for (int i = 0; i < count; i += LANES) {
+        // a fresh stack, as every scalar run starts with: a variable read
+        // before it is written must not see the previous group's value
+        if (i > 0) {
+            memset(mem + image->words, 0, stackSize * sizeof(*mem));
+        }
+        runLanes(image, mem, &rows[i], count - i < LANES ? count - i : LANES);
+    }
+    double lanes = now() - start;
+    free(mem);
+
+    if (timing) {
+        VM *vm = createVM(image);
+        FILE *devNull = fopen("/dev/null", "w");
+        start = now();
+        for (int i = 0; i < count; i++) {
+            FILE *in = fmemopen(rows[i].text, strlen(rows[i].text), "r");
+            resetRegisters(vm, in, devNull);
+            execute(vm);
+            fclose(in);
+        }
+        double scalar = now() - start;
+        fclose(devNull);
+        destroyVM(vm);
+        if (count > 0) {
+            fprintf(stderr, "spmd:   %d runs in %.3f ms (%.2f us/run, %d lanes)\n", count, lanes * 1e3, lanes * 1e6 / count, LANES);
+            fprintf(stderr, "scalar: %d runs in %.3f ms (%.2f us/run)\n", count, scalar * 1e3, scalar * 1e6 / count);
+            fprintf(stderr, "speedup: %.2fx\n", lanes > 0 ? scalar / lanes : 0.0);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        printRow(stdout, &rows[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(rows[i].text);
+        free(rows[i].in);
+        free(rows[i].out);
+    }
+    free(rows);
     return 0;
-}
\ No newline at end of file
+}
+
+// shared state of a -batch run
+typedef struct {
+    VMPool *pool;
+    int fresh; // create and destroy an instance per row instead of pooling
+    Row *rows;
+    char **results;
+    int count;
+    atomic_int nextRow;
+} Batch;
+
+// take rows until none are left, each on an instance from the pool
+void *batchWorker(void *arg) {
+    Batch *batch = arg;
+    int i;
+    while ((i = atomic_fetch_add(&batch->nextRow, 1)) < batch->count) {
+        VM *vm = batch->fresh ? createVM(batch->pool->image) : acquireVM(batch->pool);
+        size_t len = 0;
+        FILE *in = fmemopen(batch->rows[i].text, strlen(batch->rows[i].text), "r");
+        FILE *out = open_memstream(&batch->results[i], &len);
+        resetRegisters(vm, in, out);
+        execute(vm);
+        fclose(out);
+        fclose(in);
+        if (batch->fresh) {
+            destroyVM(vm);
+        } else {
+            releaseVM(batch->pool, vm);
+        }
+    }
+    return NULL;
+}
+
+// run every row on threads workers and return the seconds it took
+double runBatch(Batch *batch, int threads) {
+    atomic_store(&batch->nextRow, 0);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    double start = now();
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&workers[t], NULL, batchWorker, batch);
+    }
+    batchWorker(batch);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    double elapsed = now() - start;
+    free(workers);
+    return elapsed;
+}
+
+// run every line of stdin as the input of one run, spread over threads
+// that share a pool of instances. with timing on, the rows are run again on
+// as many threads with a freshly created instance per run, so the two
+// times differ only by what pooling saves
+int batchRun(CodeImage *image, int threads, int timing) {
+    Batch batch;
+    batch.rows = readRows(&batch.count);
+    batch.results = calloc(batch.count + 1, sizeof(char*));
+    batch.pool = createPool(image, threads);
+    batch.fresh = 0;
+    atomic_init(&batch.nextRow, 0);
+
+    double pooled = runBatch(&batch, threads);
+    for (int i = 0; i < batch.count; i++) {
+        fputs(batch.results[i], stdout);
+        free(batch.results[i]);
+    }
+
+    if (timing && batch.count > 0) {
+        batch.fresh = 1;
+        double fresh = runBatch(&batch, threads);
+        for (int i = 0; i < batch.count; i++) {
+            free(batch.results[i]);
+        }
+        fprintf(stderr, "pooled: %d runs on %d threads in %.3f ms (%.2f us/run)\n", batch.count, threads, pooled * 1e3, pooled * 1e6 / batch.count);
+        fprintf(stderr, "fresh:  %d runs on %d threads in %.3f ms (%.2f us/run)\n", batch.count, threads, fresh * 1e3, fresh * 1e6 / batch.count);
+    }
+
+    destroyPool(batch.pool);
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.rows[i].text);
+        free(batch.rows[i].in);
+    }
+    free(batch.rows);
+    free(batch.results);
+    return 0;
+}
+
+// 64-bit FNV-1a over a run of ints
+unsigned long long hashInts(unsigned long long h, const int *values, int count) {
+    const unsigned char *p = (const unsigned char*)values;
+    for (size_t i = 0; i < count * sizeof(int); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+typedef struct {
+    char name[32];
+    long long size;
+    struct timespec used;
+} CacheEntry;
+
+int compareEntries(const void *a, const void *b) {
+    const CacheEntry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// delete least recently used entries until the cache fits in limit bytes.
+// an entry's mtime is bumped on every hit so it doubles as its last use
+int evictEntries(const char *dir, long long limit, long long *total, int *entries) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    int count = 0, size = 64;
+    CacheEntry *list = malloc(size * sizeof(CacheEntry));
+    char path[4096];
+    struct dirent *e;
+    *total = 0;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (len < 5 || len >= sizeof(list[0].name) || strcmp(e->d_name + len - 4, ".run") != 0) {
+            continue;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (count == size) {
+            size *= 2;
+            list = realloc(list, size * sizeof(CacheEntry));
+        }
+        strcpy(list[count].name, e->d_name);
+        list[count].size = st.st_size;
+        list[count].used = st.st_mtim;
+        *total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    int evicted = 0;
+    if (*total > limit) {
+        qsort(list, count, sizeof(CacheEntry), compareEntries);
+        for (int i = 0; i < count && *total > limit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, list[i].name);
+            if (unlink(path) == 0) {
+                *total -= list[i].size;
+                evicted++;
+            }
+        }
+    }
+    *entries = count - evicted;
+    free(list);
+    return evicted;
+}
+
+// add to the counters kept next to the entries, hits, misses, evictions,
+// entries and bytes, and return the new totals. the running byte total
+// means only a run that stored an entry has to look at the directory, and
+// only once the cache outgrows limit (or the stats predate the total).
+// the file is locked so concurrent vms can share it
+void updateCacheStats(const char *dir, long long counts[5], long long limit) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    char text[128] = "";
+    ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+    text[n > 0 ? n : 0] = '\0';
+    long long old[5] = {0, 0, 0, 0, 0};
+    int known = sscanf(text, "%lld %lld %lld %lld %lld", &old[0], &old[1], &old[2], &old[3], &old[4]);
+    for (int i = 0; i < 5; i++) {
+        counts[i] += old[i];
+    }
+    if (counts[1] > old[1] && (counts[4] > limit || known < 5)) {
+        int entries = 0;
+        counts[2] += evictEntries(dir, limit, &counts[4], &entries);
+        counts[3] = entries;
+    }
+    n = snprintf(text, sizeof(text), "%lld %lld %lld %lld %lld\n", counts[0], counts[1], counts[2], counts[3], counts[4]);
+    if (ftruncate(fd, 0) == 0 && pwrite(fd, text, n, 0) != n) {
+        perror("stats");
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// a run only reads SYS 2 input and writes SYS 1 output, so its result is a
+// pure function of the code, the stack size and the input stream. look the pair up in dir
+// and replay the stored output, or run the program and store what it did
+int cachedRun(VM *vm, const char *dir, long long limit, int showStats) {
+    // read the whole input stream up front, it is part of the key
+    char *text = NULL;
+    size_t textLen = 0;
+    FILE *all = open_memstream(&text, &textLen);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+        fwrite(chunk, 1, n, all);
+    }
+    fclose(all);
+    Row values = readRow(text);
+
+    // the stack size decides where a run overflows, so it is part of the
+    // key too. trace is always off here, nothing else changes a run
+    int IC = vm->image->words;
+    int stackWords = vm->limit - IC;
+    unsigned long long key = hashInts(14695981039346656037ULL, &IC, 1);
+    key = hashInts(key, (const int*)vm->image->code, IC);
+    key = hashInts(key, &stackWords, 1);
+    key = hashInts(key, &values.inCount, 1);
+    key = hashInts(key, values.in, values.inCount);
+    free(values.text);
+    free(values.in);
+
+    mkdir(dir, 0755);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016llx.run", dir, key);
+
+    long long counts[5] = {0, 0, 0, 0, 0}; // hits, misses, evictions, entries, bytes
+    long long executed = 0;
+    int peakSp = 0;
+    char *result = NULL;
+    size_t resultLen = 0;
+    FILE *entry = fopen(path, "r");
+    // a "\n" in the format would also skip the newline of an empty output,
+    // so the header's own newline is read separately and the rest verbatim
+    if (entry != NULL && fscanf(entry, "instructions %lld peak %d", &executed, &peakSp) == 2 && fgetc(entry) == '\n') {
+        counts[0] = 1;
+        while ((n = fread(chunk, 1, sizeof(chunk), entry)) > 0) {
+            fwrite(chunk, 1, n, stdout);
+        }
+        fclose(entry);
+        utimensat(AT_FDCWD, path, NULL, 0);
+    } else {
+        if (entry != NULL) {
+            fclose(entry);
+        }
+        counts[1] = 1;
+        FILE *in = fmemopen(text, textLen > 0 ? textLen : 1, "r");
+        FILE *out = open_memstream(&result, &resultLen);
+        resetRegisters(vm, in, out);
+        execute(vm);
+        fclose(out);
+        fclose(in);
+        executed = vm->executed;
+        peakSp = vm->peakSp - IC + 1;
+        fputs(result, stdout);
+
+        // write to a temporary name first so readers never see half an entry
+        char tmp[4200];
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+        entry = fopen(tmp, "w");
+        if (entry != NULL) {
+            fprintf(entry, "instructions %lld peak %d\n%s", executed, peakSp, result);
+            counts[3] = 1;
+            counts[4] = ftell(entry);
+            fclose(entry);
+            // another vm may have stored the same run meanwhile
+            struct stat st;
+            if (stat(path, &st) == 0) {
+                counts[3] = 0;
+                counts[4] -= st.st_size;
+            }
+            rename(tmp, path);
+        }
+    }
+
+    int hit = counts[0] == 1;
+    updateCacheStats(dir, counts, limit);
+    if (showStats) {
+        fprintf(stderr, "cache %s: %lld instructions, peak stack %d words\n", hit ? "hit" : "miss", executed, peakSp);
+        fprintf(stderr, "cache totals: %lld hits, %lld misses, %lld evictions, %lld entries, %lld bytes\n", counts[0], counts[1], counts[2], counts[3], counts[4]);
+    }
+    free(result);
+    free(text);
+    return 0;
+}
+
+int main (int argc, char *argv[]) {
+    char *filename = NULL;
+    int forkMode = 0;
+    int spmdMode = 0;
+    int batchThreads = 0;
+    char *cacheDir = NULL;
+    long long cacheLimit = CACHE_LIMIT;
+    int stats = 0;
+    int timing = 0;
+    int stackSet = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            trace = 0;
+        } else if (strcmp(argv[i], "-fork") == 0) {
+            forkMode = 1;
+        } else if (strcmp(argv[i], "-spmd") == 0) {
+            spmdMode = 1;
+        } else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) {
+            batchThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-stack") == 0 && i + 1 < argc) {
+            stackSize = atoi(argv[++i]);
+            stackSet = 1;
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "-cachesize") == 0 && i + 1 < argc) {
+            cacheLimit = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-codecache") == 0 && i + 1 < argc) {
+            codeCacheDir = argv[++i];
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "-time") == 0) {
+            timing = 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("Usage: vm [-q] [-stack <words>] [-fork | -spmd | -batch <threads> | -cache <dir> [-cachesize <bytes>] [-stats]] [-codecache <dir>] [-time] <program>\n");
+        return 1;
+    }
+    double loadStart = now();
+    CodeImage *image = acquireImage(filename);
+    if (image == NULL) {
+        return 1;
+    }
+    if (!stackSet) {
+        stackSize = defaultStack(image);
+    }
+    VM *vm = createVM(image);
+    releaseImage(image);
+
+    if (forkMode) {
+        trace = 0;
+        if (timing) {
+            fprintf(stderr, "load+verify: %.3f ms (once)\n", (now() - loadStart) * 1e3);
+        }
+        return forkServer(vm, argv[0], filename, timing);
+    }
+    if (spmdMode) {
+        trace = 0;
+        return spmdBatch(vm->image, timing);
+    }
+    if (batchThreads > 0) {
+        trace = 0;
+        return batchRun(vm->image, batchThreads, timing);
+    }
+    if (cacheDir != NULL) {
+        trace = 0;
+        return cachedRun(vm, cacheDir, cacheLimit, stats);
+    }
+
+    resetRegisters(vm, stdin, stdout);
+
+    if (trace) {
+        printf("\t\t\tPC\tBP\tSP\tstack\n");
+        printf("Initial values:\t\t%d\t%d\t%d\n\n", vm->pc, vm->bp, vm->sp);
+    }
+
+    execute(vm);
+    destroyVM(vm);
+
+    return 0;
+}